@@ -47,7 +47,7 @@ sph_files:=$(call all-c-files-under,sha3)
 
 LOCAL_SRC_FILES=\
   cpu-miner.c util.c \
-  api.c sysinfos.c \
+  api.c sysinfos.c autotune.c \
   $(call all-c-files-under,algo) \
   $(filter-out sha3/md_helper.c,$(sph_files)) \
   $(call all-c-files-under,crypto) \
@@ -35,6 +35,8 @@
 
 #ifdef __linux__
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <errno.h>
 #endif
 
@@ -382,46 +384,7 @@ static inline void PBKDF2_SHA256_128_32_8way(uint32_t *tstate,
 #endif /* HAVE_SHA256_8WAY */
 
 
-#if defined(USE_ASM) && defined(__x86_64__)
-
-#define SCRYPT_MAX_WAYS 12
-#define HAVE_SCRYPT_3WAY 1
-int scrypt_best_throughput();
-void scrypt_core(uint32_t *X, uint32_t *V, int N);
-void scrypt_core_3way(uint32_t *X, uint32_t *V, int N);
-#if defined(USE_AVX2)
-#undef SCRYPT_MAX_WAYS
-#define SCRYPT_MAX_WAYS 24
-#define HAVE_SCRYPT_6WAY 1
-void scrypt_core_6way(uint32_t *X, uint32_t *V, int N);
-#endif
-
-#elif defined(USE_ASM) && defined(__i386__)
-
-#define SCRYPT_MAX_WAYS 4
-#define scrypt_best_throughput() 1
-void scrypt_core(uint32_t *X, uint32_t *V, int N);
-
-#elif defined(USE_ASM) && defined(__arm__) && defined(__APCS_32__)
-
-void scrypt_core(uint32_t *X, uint32_t *V, int N);
-#if defined(__ARM_NEON)
-#undef HAVE_SHA256_4WAY
-#define SCRYPT_MAX_WAYS 3
-#define HAVE_SCRYPT_3WAY 1
-#define scrypt_best_throughput() 3
-void scrypt_core_3way(uint32_t *X, uint32_t *V, int N);
-#endif
-
-#elif defined(__aarch64__)
-
-#include <arm_neon.h>
-
-#undef HAVE_SHA256_4WAY
-#define SCRYPT_MAX_WAYS 3
-#define HAVE_SCRYPT_3WAY 1
-#define scrypt_best_throughput() 3
-
+/* portable Salsa20/8, used by the C kernels */
 static inline void xor_salsa8(uint32_t B[16], const uint32_t Bx[16])
 {
 	uint32_t x00,x01,x02,x03,x04,x05,x06,x07,x08,x09,x10,x11,x12,x13,x14,x15;
@@ -491,6 +454,73 @@ static inline void xor_salsa8(uint32_t B[16], const uint32_t Bx[16])
 }
 
 
+#if defined(USE_ASM) && defined(__x86_64__)
+
+#define HAVE_SCRYPT_3WAY 1
+#define HAVE_SCRYPT_PREFETCH 1
+/*
+ * scrypt-x64.S is assembled once per prefetch hint, the _nta and _nopf
+ * copies come from scrypt-x64-nta.S and scrypt-x64-nopf.S.
+ */
+#define SCRYPT_CORE_DECL(f) \
+	void f(uint32_t *X, uint32_t *V, int N, int from, int to); \
+	void f##_nta(uint32_t *X, uint32_t *V, int N, int from, int to); \
+	void f##_nopf(uint32_t *X, uint32_t *V, int N, int from, int to)
+SCRYPT_CORE_DECL(scrypt_core_gen);
+SCRYPT_CORE_DECL(scrypt_core_xmm);
+SCRYPT_CORE_DECL(scrypt_core_3way_xmm);
+#if defined(USE_AVX)
+SCRYPT_CORE_DECL(scrypt_core_3way_avx);
+#endif
+#if defined(USE_XOP)
+SCRYPT_CORE_DECL(scrypt_core_3way_xop);
+#endif
+#if defined(USE_AVX2)
+#define HAVE_SCRYPT_6WAY 1
+#define HAVE_SCRYPT_PIPE 1
+SCRYPT_CORE_DECL(scrypt_core_6way);
+void scrypt_core_pipe_avx2(uint32_t *X, uint32_t *V, int N, int which, int from, int to);
+void scrypt_core_pipe_avx2_nta(uint32_t *X, uint32_t *V, int N, int which, int from, int to);
+void scrypt_core_pipe_avx2_nopf(uint32_t *X, uint32_t *V, int N, int which, int from, int to);
+#if defined(USE_AVX512)
+#define HAVE_SCRYPT_16WAY 1
+SCRYPT_CORE_DECL(scrypt_core_16way);
+#endif
+#endif
+
+#elif defined(USE_ASM) && defined(__i386__)
+
+/* these run all of ROMix in one call, see scrypt_core_whole() */
+#define HAVE_SCRYPT_WHOLE_GEN 1
+void scrypt_core(uint32_t *X, uint32_t *V, int N);
+
+#elif defined(USE_ASM) && defined(__arm__) && defined(__APCS_32__)
+
+#define HAVE_SCRYPT_WHOLE_GEN 1
+void scrypt_core(uint32_t *X, uint32_t *V, int N);
+#if defined(__ARM_NEON)
+#undef HAVE_SHA256_4WAY
+#define HAVE_SCRYPT_3WAY 1
+#define HAVE_SCRYPT_WHOLE_3WAY 1
+void scrypt_core_3way(uint32_t *X, uint32_t *V, int N);
+#endif
+
+#elif defined(__aarch64__)
+
+#include <arm_neon.h>
+
+#undef HAVE_SHA256_4WAY
+#define HAVE_SCRYPT_3WAY 1
+/* wider NEON kernels, from romix.cpp */
+#define HAVE_SCRYPT_NEON_LANES 1
+#define SCRYPT_CORE_DECL(f) \
+	void f(uint32_t *X, uint32_t *V, int N, int from, int to); \
+	void f##_nta(uint32_t *X, uint32_t *V, int N, int from, int to); \
+	void f##_nopf(uint32_t *X, uint32_t *V, int N, int from, int to)
+SCRYPT_CORE_DECL(scrypt_core_4way_neon);
+SCRYPT_CORE_DECL(scrypt_core_6way_neon);
+SCRYPT_CORE_DECL(scrypt_core_8way_neon);
+
 static inline void xor_salsa8_prefetch(uint32_t B[16], const uint32_t Bx[16], uint32_t* V, uint32_t N)
 {
 	uint32_t x00,x01,x02,x03,x04,x05,x06,x07,x08,x09,x10,x11,x12,x13,x14,x15;
@@ -542,7 +572,7 @@ static inline void xor_salsa8_prefetch(uint32_t B[16], const uint32_t Bx[16], ui
 #undef R
 	}
 	B[ 0] += x00;
-	uint32_t one = 32 * (B[0] & (N - 1));
+	size_t one = 32 * (size_t) (B[0] & (N - 1));
 	__builtin_prefetch(&V[one + 0]);
 	__builtin_prefetch(&V[one + 8]);
 	__builtin_prefetch(&V[one + 16]);
@@ -565,17 +595,20 @@ static inline void xor_salsa8_prefetch(uint32_t B[16], const uint32_t Bx[16], ui
 	B[15] += x15;
 }
 
-static inline void scrypt_core(uint32_t *X, uint32_t *V, int N)
+static inline void scrypt_core(uint32_t *X, uint32_t *V, int N, int from, int to)
 {
 	int i;
 
-	for (i = 0; i < N; i++) {
-		memcpy(&V[i * 32], X, 128);
-		xor_salsa8(&X[0], &X[16]);
-		xor_salsa8(&X[16], &X[0]);
+	if (from < N) {
+		for (i = from; i < to; i++) {
+			memcpy(&V[(size_t) i * 32], X, 128);
+			xor_salsa8(&X[0], &X[16]);
+			xor_salsa8(&X[16], &X[0]);
+		}
+		return;
 	}
-	for (i = 0; i < N; i++) {
-		uint32_t j = 32 * (X[16] & (N - 1));
+	for (i = from; i < to; i++) {
+		size_t j = 32 * (size_t) (X[16] & (N - 1));
 		for (uint8_t k = 0; k < 32; k++)
 			X[k] ^= V[j + k];
 		xor_salsa8(&X[0], &X[16]);
@@ -609,7 +642,12 @@ static inline void scrypt_shuffle(uint32_t B[16])
 	B[12] = x4; B[13] = x9; B[14] = x14; B[15] = x3;
 }
 
-static inline void scrypt_core_3way(uint32_t B[32 * 3], uint32_t *V, uint32_t N)
+/*
+ * Same range entry as the x86 kernels: from < N runs loop 1 over [from, to),
+ * otherwise to - from rounds of loop 2. The state goes back to B, unshuffled,
+ * at the end of every call.
+ */
+static void scrypt_core_3way(uint32_t B[32 * 3], uint32_t *V, int N, int from, int to)
 {
 	uint32_t* W = V;
 
@@ -650,8 +688,12 @@ static inline void scrypt_core_3way(uint32_t B[32 * 3], uint32_t *V, uint32_t N)
 	bc_b.val[2] = vld1q_u32(&B[(256 + 64 + 32) / 4]);
 	bc_b.val[3] = vld1q_u32(&B[(256 + 64 + 48) / 4]);
 
+	if (from >= N)
+		goto loop2;
+
 	// prep
 
+	V += 96 * (size_t) from;
 	vst1q_u32(&V[( 0) / 4], ba_a.val[0]);
 	vst1q_u32(&V[(16) / 4], ba_a.val[1]);
 	vst1q_u32(&V[(32) / 4], ba_a.val[2]);
@@ -681,7 +723,7 @@ static inline void scrypt_core_3way(uint32_t B[32 * 3], uint32_t *V, uint32_t N)
 
 	V += 96;
 
-	for (int n = 0; n < N; n++)
+	for (int n = from; n < to; n++)
 	{
 		// loop 1 part a
 		q_a.val[0] = veorq_u32(ba_b.val[0], ba_a.val[0]);
@@ -1025,21 +1067,23 @@ static inline void scrypt_core_3way(uint32_t B[32 * 3], uint32_t *V, uint32_t N)
 		}
 		V += 96;
 	}
-	V = W;
+	goto done;
 
     // loop 2
+loop2:
+	;
 
 	uint32x4x4_t x;
 
-	uint32_t one =   32 * (3 * (ba_b.val[0][0] & (N - 1)) + 0);
-	uint32_t two =   32 * (3 * (bb_b.val[0][0] & (N - 1)) + 1);
-	uint32_t three = 32 * (3 * (bc_b.val[0][0] & (N - 1)) + 2);
+	size_t one =   32 * (3 * (size_t) (ba_b.val[0][0] & (N - 1)) + 0);
+	size_t two =   32 * (3 * (size_t) (bb_b.val[0][0] & (N - 1)) + 1);
+	size_t three = 32 * (3 * (size_t) (bc_b.val[0][0] & (N - 1)) + 2);
 	x.val[0] = vld1q_u32(&W[one +  0]);
 	x.val[1] = vld1q_u32(&W[one +  4]);
 	x.val[2] = vld1q_u32(&W[one +  8]);
 	x.val[3] = vld1q_u32(&W[one + 12]);
 
-	for (int n = 0; n < N; n++)
+	for (int n = from; n < to; n++)
 	{
 		// loop 2 part a
 
@@ -1513,7 +1557,7 @@ static inline void scrypt_core_3way(uint32_t B[32 * 3], uint32_t *V, uint32_t N)
 			q_tmp.val[1] = vsriq_n_u32(q_tmp.val[1], q_tmp.val[0], 14);
 			q_a.val[0] = veorq_u32(q_tmp.val[1], q_a.val[0]);
 				ba_b.val[0] = vaddq_u32(q_a.val[0], ba_b.val[0]);
-					one =	32 * (3 * (ba_b.val[0][0] & (N - 1)) + 0);
+					one =	32 * (3 * (size_t) (ba_b.val[0][0] & (N - 1)) + 0);
 					__builtin_prefetch(&W[one + 0]);
 					__builtin_prefetch(&W[one + 8]);
 					__builtin_prefetch(&W[one + 16]);
@@ -1529,7 +1573,7 @@ static inline void scrypt_core_3way(uint32_t B[32 * 3], uint32_t *V, uint32_t N)
 			q_b.val[3] = vextq_u32(q_b.val[3], q_b.val[3], 1);
 			q_b.val[0] = veorq_u32(q_tmp.val[1], q_b.val[0]);
 				bb_b.val[0] = vaddq_u32(q_b.val[0], bb_b.val[0]);
-					two =	32 * (3 * (bb_b.val[0][0] & (N - 1)) + 1);
+					two =	32 * (3 * (size_t) (bb_b.val[0][0] & (N - 1)) + 1);
 					__builtin_prefetch(&W[two + 0]);
 					__builtin_prefetch(&W[two + 8]);
 					__builtin_prefetch(&W[two + 16]);
@@ -1541,7 +1585,7 @@ static inline void scrypt_core_3way(uint32_t B[32 * 3], uint32_t *V, uint32_t N)
 			q_c.val[3] = vextq_u32(q_c.val[3], q_c.val[3], 1);
 			q_c.val[0] = veorq_u32(q_tmp.val[1], q_c.val[0]);
 				bc_b.val[0] = vaddq_u32(q_c.val[0], bc_b.val[0]);
-					three = 32 * (3 * (bc_b.val[0][0] & (N - 1)) + 2);
+					three = 32 * (3 * (size_t) (bc_b.val[0][0] & (N - 1)) + 2);
 					__builtin_prefetch(&W[three + 0]);
 					__builtin_prefetch(&W[three + 8]);
 					__builtin_prefetch(&W[three + 16]);
@@ -1563,6 +1607,7 @@ static inline void scrypt_core_3way(uint32_t B[32 * 3], uint32_t *V, uint32_t N)
 		x.val[3] = vld1q_u32(&W[one + 12]);
 	}
 
+done:
 	vst1q_u32(&B[0],       ba_a.val[0]);
 	vst1q_u32(&B[4],       ba_a.val[1]);
 	vst1q_u32(&B[8],       ba_a.val[2]);
@@ -1600,75 +1645,6 @@ static inline void scrypt_core_3way(uint32_t B[32 * 3], uint32_t *V, uint32_t N)
 
 #else
 
-static inline void xor_salsa8(uint32_t B[16], const uint32_t Bx[16])
-{
-	uint32_t x00,x01,x02,x03,x04,x05,x06,x07,x08,x09,x10,x11,x12,x13,x14,x15;
-	int i;
-
-	x00 = (B[ 0] ^= Bx[ 0]);
-	x01 = (B[ 1] ^= Bx[ 1]);
-	x02 = (B[ 2] ^= Bx[ 2]);
-	x03 = (B[ 3] ^= Bx[ 3]);
-	x04 = (B[ 4] ^= Bx[ 4]);
-	x05 = (B[ 5] ^= Bx[ 5]);
-	x06 = (B[ 6] ^= Bx[ 6]);
-	x07 = (B[ 7] ^= Bx[ 7]);
-	x08 = (B[ 8] ^= Bx[ 8]);
-	x09 = (B[ 9] ^= Bx[ 9]);
-	x10 = (B[10] ^= Bx[10]);
-	x11 = (B[11] ^= Bx[11]);
-	x12 = (B[12] ^= Bx[12]);
-	x13 = (B[13] ^= Bx[13]);
-	x14 = (B[14] ^= Bx[14]);
-	x15 = (B[15] ^= Bx[15]);
-	for (i = 0; i < 8; i += 2) {
-		#define R(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
-		/* Operate on columns. */
-		x04 ^= R(x00+x12, 7);	x09 ^= R(x05+x01, 7);
-		x14 ^= R(x10+x06, 7);	x03 ^= R(x15+x11, 7);
-		
-		x08 ^= R(x04+x00, 9);	x13 ^= R(x09+x05, 9);
-		x02 ^= R(x14+x10, 9);	x07 ^= R(x03+x15, 9);
-		
-		x12 ^= R(x08+x04,13);	x01 ^= R(x13+x09,13);
-		x06 ^= R(x02+x14,13);	x11 ^= R(x07+x03,13);
-		
-		x00 ^= R(x12+x08,18);	x05 ^= R(x01+x13,18);
-		x10 ^= R(x06+x02,18);	x15 ^= R(x11+x07,18);
-		
-		/* Operate on rows. */
-		x01 ^= R(x00+x03, 7);	x06 ^= R(x05+x04, 7);
-		x11 ^= R(x10+x09, 7);	x12 ^= R(x15+x14, 7);
-		
-		x02 ^= R(x01+x00, 9);	x07 ^= R(x06+x05, 9);
-		x08 ^= R(x11+x10, 9);	x13 ^= R(x12+x15, 9);
-		
-		x03 ^= R(x02+x01,13);	x04 ^= R(x07+x06,13);
-		x09 ^= R(x08+x11,13);	x14 ^= R(x13+x12,13);
-		
-		x00 ^= R(x03+x02,18);	x05 ^= R(x04+x07,18);
-		x10 ^= R(x09+x08,18);	x15 ^= R(x14+x13,18);
-		#undef R
-	}
-	B[ 0] += x00;
-	B[ 1] += x01;
-	B[ 2] += x02;
-	B[ 3] += x03;
-	B[ 4] += x04;
-	B[ 5] += x05;
-	B[ 6] += x06;
-	B[ 7] += x07;
-	B[ 8] += x08;
-	B[ 9] += x09;
-	B[10] += x10;
-	B[11] += x11;
-	B[12] += x12;
-	B[13] += x13;
-	B[14] += x14;
-	B[15] += x15;
-}
-
-
 static inline void xor_salsa8_prefetch(uint32_t B[16], const uint32_t Bx[16], uint32_t* V, uint32_t N)
 {
 	uint32_t x00,x01,x02,x03,x04,x05,x06,x07,x08,x09,x10,x11,x12,x13,x14,x15;
@@ -1720,7 +1696,7 @@ static inline void xor_salsa8_prefetch(uint32_t B[16], const uint32_t Bx[16], ui
 		#undef R
 	}
 	B[ 0] += x00;
-	uint32_t one = 32 * (B[0] & (N - 1));
+	size_t one = 32 * (size_t) (B[0] & (N - 1));
 	__builtin_prefetch(&V[one + 0]);
 	__builtin_prefetch(&V[one + 8]);
 	__builtin_prefetch(&V[one + 16]);
@@ -1743,17 +1719,20 @@ static inline void xor_salsa8_prefetch(uint32_t B[16], const uint32_t Bx[16], ui
 	B[15] += x15;
 }
 
-static inline void scrypt_core(uint32_t *X, uint32_t *V, int N)
+static inline void scrypt_core(uint32_t *X, uint32_t *V, int N, int from, int to)
 {
 	int i;
 
-	for (i = 0; i < N; i++) {
-		memcpy(&V[i * 32], X, 128);
-		xor_salsa8(&X[0], &X[16]);
-		xor_salsa8(&X[16], &X[0]);
+	if (from < N) {
+		for (i = from; i < to; i++) {
+			memcpy(&V[(size_t) i * 32], X, 128);
+			xor_salsa8(&X[0], &X[16]);
+			xor_salsa8(&X[16], &X[0]);
+		}
+		return;
 	}
-	for (i = 0; i < N; i++) {
-		uint32_t j = 32 * (X[16] & (N - 1));
+	for (i = from; i < to; i++) {
+		size_t j = 32 * (size_t) (X[16] & (N - 1));
 		for (uint8_t k = 0; k < 32; k++)
 			X[k] ^= V[j + k];
 		xor_salsa8(&X[0], &X[16]);
@@ -1763,155 +1742,1781 @@ static inline void scrypt_core(uint32_t *X, uint32_t *V, int N)
 
 #endif
 
-#ifndef SCRYPT_MAX_WAYS
-#define SCRYPT_MAX_WAYS 1
-#define scrypt_best_throughput() 1
+#if defined(__SSE2__) || defined(_M_X64)
+
+/*
+ * Intrinsics kernels. In x86 builds without the assembly ones (NOASM,
+ * or compilers that do not take scrypt-x64.S) 3way-sse2 and 6way-avx2
+ * stand in for them, the hybrid kernels are built either way. Word i
+ * of each 16-word Salsa20 block is kept at position 5 * i % 16, which
+ * puts the four diagonals in four vectors so that column and row rounds
+ * become whole vector operations. Three independent vectors of state
+ * are interleaved to hide the latency of each round.
+ */
+#include <immintrin.h>
+
+#if !defined(USE_ASM) || !(defined(__x86_64__) || defined(__i386__))
+#define HAVE_SCRYPT_SSE2 1
+#endif
+#if defined(__GNUC__) || defined(_MSC_VER)
+/* built for AVX2 whatever -march says, only run if has_avx2() */
+#define HAVE_SCRYPT_AVX2_INTRIN 1
+#ifdef __GNUC__
+#define SCRYPT_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SCRYPT_TARGET_AVX2
+#endif
+#endif
+/*
+ * The rounds only get registers once inlined with constant b and bx,
+ * and with the loops over lanes and rows unrolled.
+ */
+#if defined(_MSC_VER)
+#define SCRYPT_INLINE static __forceinline
+#elif defined(__GNUC__)
+#define SCRYPT_INLINE static inline __attribute__((always_inline))
+#else
+#define SCRYPT_INLINE static inline
+#endif
+#if defined(__clang__)
+#define SCRYPT_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__) && __GNUC__ >= 8
+#define SCRYPT_UNROLL _Pragma("GCC unroll 16")
+#else
+#define SCRYPT_UNROLL
 #endif
 
-pthread_mutex_t alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
-bool printed = false;
-bool tested_hugepages = false;
-bool disable_hugepages = false;
-int hugepages_successes = 0;
-int hugepages_fails = 0;
-int hugepages_size_failed = 0;
-unsigned char *scrypt_buffer_alloc(int N, int forceThroughput)
+static inline void scrypt_diagonalize(uint32_t *B)
+{
+	uint32_t T[16];
+	int i, k;
+
+	for (k = 0; k < 32; k += 16) {
+		memcpy(T, B + k, 64);
+		for (i = 0; i < 16; i++)
+			B[k + i] = T[i * 5 % 16];
+	}
+}
+
+static inline void scrypt_undiagonalize(uint32_t *B)
 {
-	uint32_t throughput = (forceThroughput == -1 ? scrypt_best_throughput() : forceThroughput);
-	if (opt_ryzen_1x) {
-		// force throughput to be 3 (aka AVX) instead of AVX2.
-		throughput = 3;
+	uint32_t T[16];
+	int i, k;
+
+	for (k = 0; k < 32; k += 16) {
+		memcpy(T, B + k, 64);
+		for (i = 0; i < 16; i++)
+			B[k + i * 5 % 16] = T[i];
 	}
+}
 
-	uint32_t size = throughput * 32 * (N + 1) * sizeof(uint32_t);
+/* x[d] ^= R(x[a] + x[b], r) for the three interleaved states */
+#define SALSA_STEP_SSE2(d, a, b, r) \
+	SCRYPT_UNROLL for (l = 0; l < 3; l++) { \
+		t = _mm_add_epi32(x[l][a], x[l][b]); \
+		x[l][d] = _mm_xor_si128(x[l][d], _mm_slli_epi32(t, r)); \
+		x[l][d] = _mm_xor_si128(x[l][d], _mm_srli_epi32(t, 32 - r)); \
+	}
+#define SALSA_SHUF_SSE2(d, imm) \
+	SCRYPT_UNROLL for (l = 0; l < 3; l++) \
+		x[l][d] = _mm_shuffle_epi32(x[l][d], imm);
 
-#ifdef __linux__
-	pthread_mutex_lock(&alloc_mutex);
-	if (!tested_hugepages)
-	{
-		FILE* f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
-		if (f)
-		{
-			char buff[32];
-			fread(buff, 32, 1, f);
-			fclose(f);
-			if (strstr(buff, "[always]") != NULL)
-			{
-				applog(LOG_DEBUG, "HugePages type: transparent_hugepages\n");
-				disable_hugepages = true;
-			}
-		}
-		else
-		{
-		}
-		tested_hugepages = true;
+/* B[l][b..b+3] = Salsa20/8(B[l][b..b+3] ^ B[l][bx..bx+3]) */
+SCRYPT_INLINE void xor_salsa8_sse2_3way(__m128i B[3][8], int b, int bx)
+{
+	__m128i x[3][4], t;
+	int i, k, l;
+
+	SCRYPT_UNROLL
+	for (l = 0; l < 3; l++)
+		SCRYPT_UNROLL
+		for (k = 0; k < 4; k++)
+			x[l][k] = B[l][b + k] = _mm_xor_si128(B[l][b + k], B[l][bx + k]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		SALSA_STEP_SSE2(1, 0, 3, 7);
+		SALSA_STEP_SSE2(2, 1, 0, 9);
+		SALSA_STEP_SSE2(3, 2, 1, 13);
+		SALSA_STEP_SSE2(0, 3, 2, 18);
+		SALSA_SHUF_SSE2(1, 0x93);
+		SALSA_SHUF_SSE2(2, 0x4e);
+		SALSA_SHUF_SSE2(3, 0x39);
+		/* Operate on rows. */
+		SALSA_STEP_SSE2(3, 0, 1, 7);
+		SALSA_STEP_SSE2(2, 3, 0, 9);
+		SALSA_STEP_SSE2(1, 2, 3, 13);
+		SALSA_STEP_SSE2(0, 1, 2, 18);
+		SALSA_SHUF_SSE2(1, 0x39);
+		SALSA_SHUF_SSE2(2, 0x4e);
+		SALSA_SHUF_SSE2(3, 0x93);
 	}
-	pthread_mutex_unlock(&alloc_mutex);
+	SCRYPT_UNROLL
+	for (l = 0; l < 3; l++)
+		SCRYPT_UNROLL
+		for (k = 0; k < 4; k++)
+			B[l][b + k] = _mm_add_epi32(B[l][b + k], x[l][k]);
+}
 
-	if (!disable_hugepages)
-	{
-		unsigned char* m_memory = (unsigned char*)(mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, 0, 0));
-		if (m_memory == MAP_FAILED)
-		{
-			pthread_mutex_lock(&alloc_mutex);
-			hugepages_fails++;
-			hugepages_size_failed += ((size / (2 * 1024 * 1024)) + 1);
-			if( hugepages_successes == 0)
-			{
-				if (!printed)
-				{
-					applog(LOG_DEBUG, "HugePages unavailable (%d)\n", errno);
-					printed = true;
-				}
-			}
-			else
-			{
-				applog(LOG_INFO, "HugePages too small! (%d success, %d fail)\n\tNeed at most %d more hugepages\n", hugepages_successes, hugepages_fails, hugepages_size_failed);
-			}
-			pthread_mutex_unlock(&alloc_mutex);
-			m_memory = (unsigned char*)malloc(size);
+#ifdef HAVE_SCRYPT_SSE2
+static void scrypt_core_3way_sse2(uint32_t *X, uint32_t *V, int N, int from, int to)
+{
+	__m128i B[3][8];
+	__m128i *W = (__m128i *) V;
+	uint32_t j;
+	int i, k, l;
+
+	SCRYPT_UNROLL
+	for (l = 0; l < 3; l++) {
+		scrypt_diagonalize(X + 32 * l);
+		for (k = 0; k < 8; k++)
+			B[l][k] = _mm_loadu_si128((__m128i *) (X + 32 * l) + k);
+	}
+
+	if (from < N) {
+		for (i = from; i < to; i++) {
+			SCRYPT_UNROLL
+			for (l = 0; l < 3; l++)
+				for (k = 0; k < 8; k++)
+					_mm_store_si128(W + ((size_t) i * 3 + l) * 8 + k, B[l][k]);
+			xor_salsa8_sse2_3way(B, 0, 4);
+			xor_salsa8_sse2_3way(B, 4, 0);
 		}
-		else
-		{
-			pthread_mutex_lock(&alloc_mutex);
-			if (!printed)
-			{
-				printed = true;
-				applog(LOG_DEBUG, "HugePages type: preallocated\n");
+	} else {
+		for (i = from; i < to; i++) {
+			SCRYPT_UNROLL
+			for (l = 0; l < 3; l++) {
+				j = _mm_cvtsi128_si32(B[l][4]) & (N - 1);
+				for (k = 0; k < 8; k++)
+					B[l][k] = _mm_xor_si128(B[l][k],
+						_mm_load_si128(W + ((size_t) j * 3 + l) * 8 + k));
 			}
-			hugepages_successes++;
-			pthread_mutex_unlock(&alloc_mutex);
+			xor_salsa8_sse2_3way(B, 0, 4);
+			xor_salsa8_sse2_3way(B, 4, 0);
 		}
-		return m_memory;
 	}
-	else
-	{
-		return (unsigned char*)malloc(size);
+
+	SCRYPT_UNROLL
+	for (l = 0; l < 3; l++) {
+		for (k = 0; k < 8; k++)
+			_mm_storeu_si128((__m128i *) (X + 32 * l) + k, B[l][k]);
+		scrypt_undiagonalize(X + 32 * l);
 	}
-#elif defined(WIN32)
+}
+#endif /* HAVE_SCRYPT_SSE2 */
 
-	pthread_mutex_lock(&alloc_mutex);
-	if (!tested_hugepages)
-	{
-		tested_hugepages = true;
-		
-		HANDLE           hToken;
-		TOKEN_PRIVILEGES tp;
-		BOOL             status;
+#ifdef HAVE_SCRYPT_AVX2_INTRIN
 
-		if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
-			disable_hugepages = true;
+/* as above, with two lanes per vector: lane 2p low, lane 2p + 1 high */
+#define SALSA_STEP_AVX2(d, a, b, r) \
+	SCRYPT_UNROLL for (l = 0; l < 3; l++) { \
+		t = _mm256_add_epi32(x[l][a], x[l][b]); \
+		x[l][d] = _mm256_xor_si256(x[l][d], _mm256_slli_epi32(t, r)); \
+		x[l][d] = _mm256_xor_si256(x[l][d], _mm256_srli_epi32(t, 32 - r)); \
+	}
+#define SALSA_SHUF_AVX2(d, imm) \
+	SCRYPT_UNROLL for (l = 0; l < 3; l++) \
+		x[l][d] = _mm256_shuffle_epi32(x[l][d], imm);
 
-		if (!disable_hugepages && !LookupPrivilegeValue(NULL, TEXT("SeLockMemoryPrivilege"), &tp.Privileges[0].Luid))
-			disable_hugepages = true;
+SCRYPT_TARGET_AVX2
+SCRYPT_INLINE void xor_salsa8_avx2_6way(__m256i B[3][8], int b, int bx)
+{
+	__m256i x[3][4], t;
+	int i, k, l;
 
-		if (!disable_hugepages)
-		{
-			tp.PrivilegeCount = 1;
-			tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	SCRYPT_UNROLL
+	for (l = 0; l < 3; l++)
+		SCRYPT_UNROLL
+		for (k = 0; k < 4; k++)
+			x[l][k] = B[l][b + k] = _mm256_xor_si256(B[l][b + k], B[l][bx + k]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		SALSA_STEP_AVX2(1, 0, 3, 7);
+		SALSA_STEP_AVX2(2, 1, 0, 9);
+		SALSA_STEP_AVX2(3, 2, 1, 13);
+		SALSA_STEP_AVX2(0, 3, 2, 18);
+		SALSA_SHUF_AVX2(1, 0x93);
+		SALSA_SHUF_AVX2(2, 0x4e);
+		SALSA_SHUF_AVX2(3, 0x39);
+		/* Operate on rows. */
+		SALSA_STEP_AVX2(3, 0, 1, 7);
+		SALSA_STEP_AVX2(2, 3, 0, 9);
+		SALSA_STEP_AVX2(1, 2, 3, 13);
+		SALSA_STEP_AVX2(0, 1, 2, 18);
+		SALSA_SHUF_AVX2(1, 0x39);
+		SALSA_SHUF_AVX2(2, 0x4e);
+		SALSA_SHUF_AVX2(3, 0x93);
+	}
+	SCRYPT_UNROLL
+	for (l = 0; l < 3; l++)
+		SCRYPT_UNROLL
+		for (k = 0; k < 4; k++)
+			B[l][b + k] = _mm256_add_epi32(B[l][b + k], x[l][k]);
+}
 
-			status = AdjustTokenPrivileges(hToken, FALSE, &tp, 0, (PTOKEN_PRIVILEGES)NULL, 0);
-		}
+#ifdef HAVE_SCRYPT_SSE2
+/* V keeps each lane's blocks contiguous, the two lanes of a vector index apart */
+SCRYPT_TARGET_AVX2
+static void scrypt_core_6way_avx2(uint32_t *X, uint32_t *V, int N, int from, int to)
+{
+	__m256i B[3][8];
+	__m128i *W = (__m128i *) V, *lo, *hi;
+	uint32_t j0, j1;
+	int i, k, l;
+
+	for (l = 0; l < 6; l++)
+		scrypt_diagonalize(X + 32 * l);
+	SCRYPT_UNROLL
+	for (l = 0; l < 3; l++) {
+		lo = (__m128i *) (X + 64 * l);
+		for (k = 0; k < 8; k++)
+			B[l][k] = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadu_si128(lo + k)), _mm_loadu_si128(lo + 8 + k), 1);
+	}
 
-		if (disable_hugepages || (!status || (GetLastError() != ERROR_SUCCESS)))
-		{
-			applog(LOG_DEBUG, "HugePages: not enabled, view readme for more info!");
-			disable_hugepages = true;
+	if (from < N) {
+		for (i = from; i < to; i++) {
+			SCRYPT_UNROLL
+			for (l = 0; l < 3; l++) {
+				lo = W + ((size_t) i * 6 + 2 * l) * 8;
+				for (k = 0; k < 8; k++) {
+					_mm_store_si128(lo + k, _mm256_castsi256_si128(B[l][k]));
+					_mm_store_si128(lo + 8 + k, _mm256_extracti128_si256(B[l][k], 1));
+				}
+			}
+			xor_salsa8_avx2_6way(B, 0, 4);
+			xor_salsa8_avx2_6way(B, 4, 0);
+		}
+	} else {
+		for (i = from; i < to; i++) {
+			SCRYPT_UNROLL
+			for (l = 0; l < 3; l++) {
+				j0 = _mm_cvtsi128_si32(_mm256_castsi256_si128(B[l][4])) & (N - 1);
+				j1 = _mm_cvtsi128_si32(_mm256_extracti128_si256(B[l][4], 1)) & (N - 1);
+				lo = W + ((size_t) j0 * 6 + 2 * l) * 8;
+				hi = W + ((size_t) j1 * 6 + 2 * l + 1) * 8;
+				for (k = 0; k < 8; k++)
+					B[l][k] = _mm256_xor_si256(B[l][k], _mm256_inserti128_si256(
+						_mm256_castsi128_si256(_mm_load_si128(lo + k)),
+						_mm_load_si128(hi + k), 1));
+			}
+			xor_salsa8_avx2_6way(B, 0, 4);
+			xor_salsa8_avx2_6way(B, 4, 0);
 		}
-
-		CloseHandle(hToken);
 	}
-	pthread_mutex_unlock(&alloc_mutex);
-
-	if (tested_hugepages && !disable_hugepages)
-	{   
-		int size = N * scrypt_best_throughput() * 128;
-		SIZE_T iLargePageMin = GetLargePageMinimum();
-		if (size < iLargePageMin)
-			size = iLargePageMin;
 
-		unsigned char *scratchpad = VirtualAllocEx(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
-		if (!scratchpad)
-		{
-			applog(LOG_ERR, "Large page allocation failed.");
-			scratchpad = VirtualAllocEx(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	SCRYPT_UNROLL
+	for (l = 0; l < 3; l++) {
+		lo = (__m128i *) (X + 64 * l);
+		for (k = 0; k < 8; k++) {
+			_mm_storeu_si128(lo + k, _mm256_castsi256_si128(B[l][k]));
+			_mm_storeu_si128(lo + 8 + k, _mm256_extracti128_si256(B[l][k], 1));
 		}
-
-		return scratchpad;
-	}
-	else
-	{
-		return (unsigned char*)malloc(size);
 	}
-
-#else
-	return (unsigned char*)malloc(size);
-#endif
+	for (l = 0; l < 6; l++)
+		scrypt_undiagonalize(X + 32 * l);
 }
+#endif /* HAVE_SCRYPT_SSE2 */
 
-static void scrypt_1024_1_1_256(const uint32_t *input, uint32_t *output,
-	uint32_t *midstate, unsigned char *scratchpad, int N)
-{
+#if defined(__x86_64__) || defined(_M_X64)
+#define HAVE_SCRYPT_HYBRID 1
+
+/*
+ * Hybrid kernels: the six lanes of 6way-avx2 plus S lanes kept in
+ * general purpose registers, stepped from the same round loop so that
+ * the scalar ALUs and load ports the vector rounds leave idle do some
+ * of the work. Scalar lanes keep the natural word order, in X and in V.
+ */
+#define SCRYPT_ROTL(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+#define SALSA_STEP4_GPR(r, d0, a0, b0, d1, a1, b1, d2, a2, b2, d3, a3, b3) \
+	SCRYPT_UNROLL for (s = 0; s < S; s++) { \
+		y[s][d0] ^= SCRYPT_ROTL(y[s][a0] + y[s][b0], r); \
+		y[s][d1] ^= SCRYPT_ROTL(y[s][a1] + y[s][b1], r); \
+		y[s][d2] ^= SCRYPT_ROTL(y[s][a2] + y[s][b2], r); \
+		y[s][d3] ^= SCRYPT_ROTL(y[s][a3] + y[s][b3], r); \
+	}
+
+SCRYPT_TARGET_AVX2
+SCRYPT_INLINE void xor_salsa8_hybrid(__m256i B[3][8], uint32_t (*Y)[32],
+	const int S, int b, int bx)
+{
+	__m256i x[3][4], t;
+	uint32_t y[2][16];
+	int i, k, l, s;
+
+	SCRYPT_UNROLL
+	for (l = 0; l < 3; l++)
+		SCRYPT_UNROLL
+		for (k = 0; k < 4; k++)
+			x[l][k] = B[l][b + k] = _mm256_xor_si256(B[l][b + k], B[l][bx + k]);
+	SCRYPT_UNROLL
+	for (s = 0; s < S; s++)
+		SCRYPT_UNROLL
+		for (k = 0; k < 16; k++)
+			y[s][k] = (Y[s][4 * b + k] ^= Y[s][4 * bx + k]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		SALSA_STEP_AVX2(1, 0, 3, 7);
+		SALSA_STEP4_GPR( 7,  4,  0, 12,  9,  5,  1, 14, 10,  6,  3, 15, 11);
+		SALSA_STEP_AVX2(2, 1, 0, 9);
+		SALSA_STEP4_GPR( 9,  8,  4,  0, 13,  9,  5,  2, 14, 10,  7,  3, 15);
+		SALSA_STEP_AVX2(3, 2, 1, 13);
+		SALSA_STEP4_GPR(13, 12,  8,  4,  1, 13,  9,  6,  2, 14, 11,  7,  3);
+		SALSA_STEP_AVX2(0, 3, 2, 18);
+		SALSA_STEP4_GPR(18,  0, 12,  8,  5,  1, 13, 10,  6,  2, 15, 11,  7);
+		SALSA_SHUF_AVX2(1, 0x93);
+		SALSA_SHUF_AVX2(2, 0x4e);
+		SALSA_SHUF_AVX2(3, 0x39);
+		/* Operate on rows. */
+		SALSA_STEP_AVX2(3, 0, 1, 7);
+		SALSA_STEP4_GPR( 7,  1,  0,  3,  6,  5,  4, 11, 10,  9, 12, 15, 14);
+		SALSA_STEP_AVX2(2, 3, 0, 9);
+		SALSA_STEP4_GPR( 9,  2,  1,  0,  7,  6,  5,  8, 11, 10, 13, 12, 15);
+		SALSA_STEP_AVX2(1, 2, 3, 13);
+		SALSA_STEP4_GPR(13,  3,  2,  1,  4,  7,  6,  9,  8, 11, 14, 13, 12);
+		SALSA_STEP_AVX2(0, 1, 2, 18);
+		SALSA_STEP4_GPR(18,  0,  3,  2,  5,  4,  7, 10,  9,  8, 15, 14, 13);
+		SALSA_SHUF_AVX2(1, 0x39);
+		SALSA_SHUF_AVX2(2, 0x4e);
+		SALSA_SHUF_AVX2(3, 0x93);
+	}
+	SCRYPT_UNROLL
+	for (l = 0; l < 3; l++)
+		SCRYPT_UNROLL
+		for (k = 0; k < 4; k++)
+			B[l][b + k] = _mm256_add_epi32(B[l][b + k], x[l][k]);
+	SCRYPT_UNROLL
+	for (s = 0; s < S; s++)
+		SCRYPT_UNROLL
+		for (k = 0; k < 16; k++)
+			Y[s][4 * b + k] += y[s][k];
+}
+
+/* lanes 0-5 as in scrypt_core_6way_avx2, lanes 6 to 5 + S in Y */
+SCRYPT_TARGET_AVX2
+SCRYPT_INLINE void scrypt_core_hybrid(uint32_t *X, uint32_t *V, int N, int from, int to,
+	const int S)
+{
+	const int L = 6 + S;
+	__m256i B[3][8];
+	uint32_t Y[2][32];
+	__m128i *W = (__m128i *) V, *lo, *hi;
+	uint32_t j0, j1, *v;
+	int i, k, l, s;
+
+	for (l = 0; l < 6; l++)
+		scrypt_diagonalize(X + 32 * l);
+	for (l = 0; l < 3; l++) {
+		lo = (__m128i *) (X + 64 * l);
+		for (k = 0; k < 8; k++)
+			B[l][k] = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadu_si128(lo + k)), _mm_loadu_si128(lo + 8 + k), 1);
+	}
+	for (s = 0; s < S; s++)
+		memcpy(Y[s], X + 32 * (6 + s), 128);
+
+	if (from < N) {
+		for (i = from; i < to; i++) {
+			for (l = 0; l < 3; l++) {
+				lo = W + ((size_t) i * L + 2 * l) * 8;
+				for (k = 0; k < 8; k++) {
+					_mm_store_si128(lo + k, _mm256_castsi256_si128(B[l][k]));
+					_mm_store_si128(lo + 8 + k, _mm256_extracti128_si256(B[l][k], 1));
+				}
+			}
+			for (s = 0; s < S; s++)
+				memcpy(V + ((size_t) i * L + 6 + s) * 32, Y[s], 128);
+			xor_salsa8_hybrid(B, Y, S, 0, 4);
+			xor_salsa8_hybrid(B, Y, S, 4, 0);
+		}
+	} else {
+		for (i = from; i < to; i++) {
+			for (l = 0; l < 3; l++) {
+				j0 = _mm_cvtsi128_si32(_mm256_castsi256_si128(B[l][4])) & (N - 1);
+				j1 = _mm_cvtsi128_si32(_mm256_extracti128_si256(B[l][4], 1)) & (N - 1);
+				lo = W + ((size_t) j0 * L + 2 * l) * 8;
+				hi = W + ((size_t) j1 * L + 2 * l + 1) * 8;
+				for (k = 0; k < 8; k++)
+					B[l][k] = _mm256_xor_si256(B[l][k], _mm256_inserti128_si256(
+						_mm256_castsi128_si256(_mm_load_si128(lo + k)),
+						_mm_load_si128(hi + k), 1));
+			}
+			for (s = 0; s < S; s++) {
+				v = V + ((size_t) (Y[s][16] & (N - 1)) * L + 6 + s) * 32;
+				for (k = 0; k < 32; k++)
+					Y[s][k] ^= v[k];
+			}
+			xor_salsa8_hybrid(B, Y, S, 0, 4);
+			xor_salsa8_hybrid(B, Y, S, 4, 0);
+		}
+	}
+
+	for (l = 0; l < 3; l++) {
+		lo = (__m128i *) (X + 64 * l);
+		for (k = 0; k < 8; k++) {
+			_mm_storeu_si128(lo + k, _mm256_castsi256_si128(B[l][k]));
+			_mm_storeu_si128(lo + 8 + k, _mm256_extracti128_si256(B[l][k], 1));
+		}
+	}
+	for (l = 0; l < 6; l++)
+		scrypt_undiagonalize(X + 32 * l);
+	for (s = 0; s < S; s++)
+		memcpy(X + 32 * (6 + s), Y[s], 128);
+}
+
+SCRYPT_TARGET_AVX2
+static void scrypt_core_7way_hybrid(uint32_t *X, uint32_t *V, int N, int from, int to)
+{
+	scrypt_core_hybrid(X, V, N, from, to, 1);
+}
+
+SCRYPT_TARGET_AVX2
+static void scrypt_core_8way_hybrid(uint32_t *X, uint32_t *V, int N, int from, int to)
+{
+	scrypt_core_hybrid(X, V, N, from, to, 2);
+}
+#endif /* __x86_64__ */
+
+#endif /* HAVE_SCRYPT_AVX2_INTRIN */
+#endif /* __SSE2__ */
+
+
+/* lane-generic C++ kernels, see romix.cpp */
+void scrypt_core_2way_c(uint32_t *X, uint32_t *V, int N, int from, int to);
+void scrypt_core_4way_c(uint32_t *X, uint32_t *V, int N, int from, int to);
+void scrypt_core_6way_c(uint32_t *X, uint32_t *V, int N, int from, int to);
+void scrypt_core_8way_c(uint32_t *X, uint32_t *V, int N, int from, int to);
+void scrypt_core_16way_c(uint32_t *X, uint32_t *V, int N, int from, int to);
+void scrypt_core_32way_c(uint32_t *X, uint32_t *V, int N, int from, int to);
+/* V layout of the romix.cpp kernels, see scrypt_set_layout() */
+extern int scrypt_v_layout;
+size_t scrypt_layout_bytes(int L, int N);
+
+/* lanes of the widest kernel, 32way-c */
+#define SCRYPT_MAX_WAYS 32
+#if SCRYPT_MAX_WAYS > WORK_MAX_NONCES
+#error "a batch can win more nonces than struct work holds"
+#endif
+
+#define SCRYPT_TMTO_MAX 64
+
+/* V keeps one block out of scrypt_tmto in the tmto kernel */
+static int scrypt_tmto = 2;
+
+/*
+ * Time-memory tradeoff ROMix for hosts short on RAM: the first loop only
+ * stores every scrypt_tmto-th block, and the second one rebuilds V[j] from
+ * the stored block below it. V shrinks to N / scrypt_tmto blocks, for
+ * (scrypt_tmto - 1) / 2 extra BlockMix per iteration on average.
+ */
+static void scrypt_core_tmto(uint32_t *X, uint32_t *V, int N, int from, int to)
+{
+	uint32_t T[32];
+	uint32_t mask = scrypt_tmto - 1;
+	int i, shift = 0;
+	uint32_t j, k;
+
+	while ((1 << shift) < scrypt_tmto)
+		shift++;
+
+	if (from < N) {
+		for (i = from; i < to; i++) {
+			if (!(i & mask))
+				memcpy(&V[(size_t) (i >> shift) * 32], X, 128);
+			xor_salsa8(&X[0], &X[16]);
+			xor_salsa8(&X[16], &X[0]);
+		}
+		return;
+	}
+	for (i = from; i < to; i++) {
+		j = X[16] & (N - 1);
+		memcpy(T, &V[(size_t) (j >> shift) * 32], 128);
+		for (k = j & mask; k; k--) {
+			xor_salsa8(&T[0], &T[16]);
+			xor_salsa8(&T[16], &T[0]);
+		}
+		for (k = 0; k < 32; k++)
+			X[k] ^= T[k];
+		xor_salsa8(&X[0], &X[16]);
+		xor_salsa8(&X[16], &X[0]);
+	}
+}
+
+#ifdef HAVE_SCRYPT_PIPE
+/*
+ * Kept at the start of a pipelined thread's scratchpad between
+ * scanhash calls: the batch whose first ROMix loop already ran waits
+ * in X slot "which", with its HMAC states and first nonce.
+ */
+#define SCRYPT_PIPE_LANES 3
+
+struct scrypt_pipe_state {
+	uint32_t X[2 * SCRYPT_PIPE_LANES * 32];
+	uint32_t tstate[2 * SCRYPT_PIPE_LANES * 8];
+	uint32_t ostate[2 * SCRYPT_PIPE_LANES * 8];
+	uint32_t data[20];
+	uint32_t N;		/* of the batch in flight */
+	int which;
+	int valid;
+	uint32_t dropped;	/* lanes thrown away in flight, see scrypt_pipe_dropped() */
+};
+#endif
+
+/* how ROMix kernels prefetch V[j] as soon as j is known */
+enum scrypt_prefetch {
+	SCRYPT_PREFETCH_T0,
+	SCRYPT_PREFETCH_NTA,
+	SCRYPT_PREFETCH_OFF,
+	SCRYPT_PREFETCH_MODES
+};
+
+static const char *scrypt_prefetch_names[SCRYPT_PREFETCH_MODES] = {
+	"t0", "nta", "off"
+};
+
+/*
+ * V layouts of the kernels with layouts set, indexed by scrypt_v_layout:
+ * lanes interleaved block by block, each lane on its own run of V
+ * (staggered by a page and a block, or back to back), and each of them
+ * with the first loop's stores streamed around the caches.
+ */
+static const char *scrypt_layout_names[] = {
+	"interleave", "interleave-nt", "stagger", "stagger-nt", "contig", "contig-nt"
+};
+
+/*
+ * ROMix kernels, most preferred first. probe() returns 0 if the CPU
+ * cannot run the kernel, 1 if it can but another one is expected to be
+ * faster, 2 if it is a good pick for this CPU. No probe means 2.
+ * core() runs ROMix iterations from to to - 1, counted across both
+ * loops: below N the first one, N and up the second. A call stays in
+ * one loop, and X holds the state in between, see scrypt_romix().
+ * Pipelined kernels have no core(): pipe() overlaps two batches of
+ * ways / 2 lanes over iterations from to to - 1 of both loops at once,
+ * see scanhash_scrypt_pipe().
+ * Both come in one variant per prefetch hint, indexed by
+ * enum scrypt_prefetch; kernels without prefetches repeat the same one.
+ */
+struct scrypt_kernel {
+	const char *name;
+	int ways;
+	int (*probe)(void);
+	void (*core[SCRYPT_PREFETCH_MODES])(uint32_t *X, uint32_t *V, int N, int from, int to);
+	void (*pipe[SCRYPT_PREFETCH_MODES])(uint32_t *X, uint32_t *V, int N, int which, int from, int to);
+	bool layouts;	/* follows scrypt_set_layout(), the others have a fixed V layout */
+	bool whole;	/* core() only takes 0 to 2 * N in one call */
+};
+
+#define SCRYPT_CORES_ONE(f) { f, f, f }
+#define SCRYPT_CORES_PF(f) { f, f##_nta, f##_nopf }
+#ifdef HAVE_SCRYPT_PREFETCH
+#define SCRYPT_CORES(f) SCRYPT_CORES_PF(f)
+#else
+#define SCRYPT_CORES(f) SCRYPT_CORES_ONE(f)
+#endif
+
+/* the i386 and ARM asm kernels have no range entry */
+#if defined(HAVE_SCRYPT_WHOLE_GEN)
+static void scrypt_core_whole(uint32_t *X, uint32_t *V, int N, int from, int to)
+{
+	scrypt_core(X, V, N);
+}
+#endif
+#if defined(HAVE_SCRYPT_WHOLE_3WAY)
+static void scrypt_core_3way_whole(uint32_t *X, uint32_t *V, int N, int from, int to)
+{
+	scrypt_core_3way(X, V, N);
+}
+#endif
+
+#if defined(USE_ASM) && defined(__x86_64__)
+#if defined(HAVE_SCRYPT_16WAY)
+static int scrypt_probe_avx512(void) { return has_avx512() ? 2 : 0; }
+#endif
+#if defined(HAVE_SCRYPT_6WAY)
+static int scrypt_probe_avx2(void) { return has_avx2() ? 2 : 0; }
+#endif
+#if defined(HAVE_SCRYPT_PIPE)
+/* only picked by --kernel or --autotune */
+static int scrypt_probe_pipe_avx2(void) { return has_avx2() ? 1 : 0; }
+#endif
+#if defined(USE_XOP)
+static int scrypt_probe_xop(void) { return has_xop() ? 2 : 0; }
+#endif
+#if defined(USE_AVX)
+static int scrypt_probe_avx(void) { return has_avx() ? 2 : 0; }
+#endif
+static int scrypt_probe_3way_xmm(void) { return cpu_has_slow_simd() ? 1 : 2; }
+/* GenuineIntel processors have fast SIMD */
+static int scrypt_probe_xmm(void) { return cpu_is_intel() ? 2 : 1; }
+#elif defined(HAVE_SCRYPT_AVX2_INTRIN) && defined(HAVE_SCRYPT_SSE2)
+static int scrypt_probe_avx2(void) { return has_avx2() ? 2 : 0; }
+#elif defined(HAVE_SCRYPT_NEON_LANES)
+/* the big out-of-order cores keep six lanes in flight, 4 and 8 are for --autotune */
+static int scrypt_probe_neon_wide(void) { return cpu_has_wide_neon() ? 2 : 1; }
+#endif
+#if defined(HAVE_SCRYPT_HYBRID)
+static int scrypt_probe_hybrid(void) { return has_avx2() ? 1 : 0; }
+#endif
+/* only picked by --kernel, --tmto or --autotune */
+static int scrypt_probe_tmto(void) { return 1; }
+static int scrypt_probe_lanes(void) { return 1; }
+
+static const struct scrypt_kernel scrypt_kernels[] = {
+#if defined(USE_ASM) && defined(__x86_64__)
+#if defined(HAVE_SCRYPT_16WAY)
+	{ "16way-avx512", 16, scrypt_probe_avx512, SCRYPT_CORES(scrypt_core_16way) },
+#endif
+#if defined(HAVE_SCRYPT_6WAY)
+	{ "6way-avx2", 6, scrypt_probe_avx2, SCRYPT_CORES(scrypt_core_6way) },
+#endif
+#if defined(HAVE_SCRYPT_PIPE)
+	{ "pipe-avx2", 6, scrypt_probe_pipe_avx2, { NULL }, SCRYPT_CORES(scrypt_core_pipe_avx2) },
+#endif
+#if defined(USE_XOP)
+	{ "3way-xop", 3, scrypt_probe_xop, SCRYPT_CORES(scrypt_core_3way_xop) },
+#endif
+#if defined(USE_AVX)
+	{ "3way-avx", 3, scrypt_probe_avx, SCRYPT_CORES(scrypt_core_3way_avx) },
+#endif
+	{ "3way-xmm", 3, scrypt_probe_3way_xmm, SCRYPT_CORES(scrypt_core_3way_xmm) },
+	{ "xmm", 1, scrypt_probe_xmm, SCRYPT_CORES(scrypt_core_xmm) },
+	{ "gen", 1, NULL, SCRYPT_CORES(scrypt_core_gen) },
+#else
+#if defined(HAVE_SCRYPT_AVX2_INTRIN) && defined(HAVE_SCRYPT_SSE2)
+	{ "6way-avx2", 6, scrypt_probe_avx2, SCRYPT_CORES(scrypt_core_6way_avx2) },
+#endif
+#if defined(HAVE_SCRYPT_SSE2)
+	{ "3way-sse2", 3, NULL, SCRYPT_CORES(scrypt_core_3way_sse2) },
+#endif
+#if defined(HAVE_SCRYPT_NEON_LANES)
+	{ "6way-neon", 6, scrypt_probe_neon_wide, SCRYPT_CORES_PF(scrypt_core_6way_neon), { NULL }, true },
+	{ "8way-neon", 8, scrypt_probe_lanes, SCRYPT_CORES_PF(scrypt_core_8way_neon), { NULL }, true },
+	{ "4way-neon", 4, scrypt_probe_lanes, SCRYPT_CORES_PF(scrypt_core_4way_neon), { NULL }, true },
+#endif
+#if defined(HAVE_SCRYPT_WHOLE_3WAY)
+	{ "3way-neon", 3, NULL, SCRYPT_CORES(scrypt_core_3way_whole), { NULL }, false, true },
+#elif defined(HAVE_SCRYPT_3WAY)
+	{ "3way-neon", 3, NULL, SCRYPT_CORES(scrypt_core_3way) },
+#endif
+#if defined(HAVE_SCRYPT_WHOLE_GEN)
+	{ "gen", 1, NULL, SCRYPT_CORES(scrypt_core_whole), { NULL }, false, true },
+#else
+	{ "gen", 1, NULL, SCRYPT_CORES(scrypt_core) },
+#endif
+#endif
+#if defined(HAVE_SCRYPT_HYBRID)
+	{ "7way-hybrid", 7, scrypt_probe_hybrid, SCRYPT_CORES_ONE(scrypt_core_7way_hybrid) },
+	{ "8way-hybrid", 8, scrypt_probe_hybrid, SCRYPT_CORES_ONE(scrypt_core_8way_hybrid) },
+#endif
+	{ "2way-c", 2, scrypt_probe_lanes, SCRYPT_CORES_ONE(scrypt_core_2way_c), { NULL }, true },
+	{ "4way-c", 4, scrypt_probe_lanes, SCRYPT_CORES_ONE(scrypt_core_4way_c), { NULL }, true },
+	{ "6way-c", 6, scrypt_probe_lanes, SCRYPT_CORES_ONE(scrypt_core_6way_c), { NULL }, true },
+	{ "8way-c", 8, scrypt_probe_lanes, SCRYPT_CORES_ONE(scrypt_core_8way_c), { NULL }, true },
+	{ "16way-c", 16, scrypt_probe_lanes, SCRYPT_CORES_ONE(scrypt_core_16way_c), { NULL }, true },
+	{ "32way-c", 32, scrypt_probe_lanes, SCRYPT_CORES_ONE(scrypt_core_32way_c), { NULL }, true },
+	{ "tmto", 1, scrypt_probe_tmto, SCRYPT_CORES_ONE(scrypt_core_tmto) },
+};
+
+/* kernel used by the default threads, and by the oneway threads */
+static const struct scrypt_kernel *scrypt_kernel = NULL;
+static const struct scrypt_kernel *scrypt_kernel_1way = NULL;
+/* hashes per scanhash_scrypt round of a default thread */
+static int scrypt_lanes = 1;
+static int scrypt_prefetch = SCRYPT_PREFETCH_T0;
+
+static int scrypt_kernel_probe(const struct scrypt_kernel *k)
+{
+	if (!k->probe)
+		return 2;
+	return k->probe();
+}
+
+/* whether a wrapper runs four calls in a row of a kernel this wide */
+static bool scrypt_ways_4x(int ways)
+{
+	switch (ways) {
+#ifdef HAVE_SHA256_4WAY
+	case 1:
+		return sha256_use_4way();
+#ifdef HAVE_SCRYPT_3WAY
+	case 3:
+		return sha256_use_4way();
+#endif
+#endif
+#ifdef HAVE_SCRYPT_6WAY
+	case 6:
+		return true;
+#endif
+	}
+	return false;
+}
+
+bool scrypt_set_kernel(const char *name)
+{
+	const struct scrypt_kernel *best = NULL, *best_1way = NULL;
+	bool automatic = !name || !strcasecmp(name, "auto");
+	char list[256] = "auto";
+	int i, rank;
+
+	for (i = 0; i < ARRAY_SIZE(scrypt_kernels); i++) {
+		const struct scrypt_kernel *k = &scrypt_kernels[i];
+		rank = scrypt_kernel_probe(k);
+		if (rank) {
+			strcat(list, " ");
+			strcat(list, k->name);
+		}
+		if (rank == 2 && k->ways == 1 && !best_1way)
+			best_1way = k;
+		if (!automatic) {
+			if (!strcasecmp(name, k->name) && rank)
+				best = k;
+			continue;
+		}
+		if (rank < 2 || best)
+			continue;
+		// --ryzen: force AVX, and disable AVX2.
+		if (opt_ryzen_1x && k->ways > 3)
+			continue;
+		if (opt_no_avx512 && k->ways == 16)
+			continue;
+		best = k;
+	}
+
+	if (!best) {
+		applog(LOG_ERR, "Unknown or unsupported scrypt kernel '%s' (available: %s)",
+			name, list);
+		return false;
+	}
+	if (best->ways == 1)
+		best_1way = best;
+
+	scrypt_kernel = best;
+	scrypt_kernel_1way = best_1way;
+	scrypt_lanes = best->ways;
+	if (best->pipe[0])
+		scrypt_lanes = best->ways / 2;
+	else if (scrypt_ways_4x(best->ways))
+		scrypt_lanes *= 4;
+	return true;
+}
+
+/*
+ * A default thread hashes either one kernel call worth of lanes, or four
+ * calls in a row so that the PBKDF2 steps run on the 4-way SHA-256 code.
+ */
+bool scrypt_set_lanes(int lanes)
+{
+	int ways;
+
+	if (!scrypt_kernel)
+		scrypt_set_kernel(NULL);
+	ways = scrypt_kernel->ways;
+
+	if (scrypt_kernel->pipe[0]) {
+		if (lanes != ways / 2)
+			return false;
+		goto valid;
+	}
+	if (lanes == ways)
+		goto valid;
+	if (lanes == 4 * ways && scrypt_ways_4x(ways))
+		goto valid;
+	return false;
+valid:
+	scrypt_lanes = lanes;
+	return true;
+}
+
+int scrypt_get_lanes(void)
+{
+	return scrypt_lanes;
+}
+
+/* ratio of the tmto kernel, a power of two up to SCRYPT_TMTO_MAX */
+bool scrypt_set_tmto(int ratio)
+{
+	if (ratio < 2 || ratio > SCRYPT_TMTO_MAX || (ratio & (ratio - 1))) {
+		applog(LOG_ERR, "Invalid TMTO ratio %d, use a power of two from 2 to %d",
+			ratio, SCRYPT_TMTO_MAX);
+		return false;
+	}
+	scrypt_tmto = ratio;
+	return true;
+}
+
+int scrypt_get_tmto(void)
+{
+	return scrypt_tmto;
+}
+
+/* name and lane count of kernel i, NULL if this CPU cannot run it */
+const char *scrypt_kernel_info(int i, int *ways)
+{
+	if (i < 0 || i >= ARRAY_SIZE(scrypt_kernels))
+		return NULL;
+	if (!scrypt_kernel_probe(&scrypt_kernels[i]))
+		return NULL;
+	*ways = scrypt_kernels[i].ways;
+	return scrypt_kernels[i].name;
+}
+
+int scrypt_kernel_count(void)
+{
+	return ARRAY_SIZE(scrypt_kernels);
+}
+
+/* name of the kernel a thread with this forceThroughput will run */
+const char *scrypt_kernel_name(int forceThroughput)
+{
+	if (!scrypt_kernel)
+		scrypt_set_kernel(NULL);
+	if (forceThroughput == 1)
+		return scrypt_kernel_1way->name;
+	return scrypt_kernel->name;
+}
+
+bool scrypt_set_prefetch(const char *name)
+{
+	int i;
+
+	for (i = 0; i < SCRYPT_PREFETCH_MODES; i++) {
+		if (!strcasecmp(name, scrypt_prefetch_names[i])) {
+			scrypt_prefetch = i;
+			return true;
+		}
+	}
+	applog(LOG_ERR, "Unknown prefetch hint '%s' (available: t0 nta off)", name);
+	return false;
+}
+
+/* name of prefetch hint i, or of the current one if i < 0 */
+const char *scrypt_prefetch_name(int i)
+{
+	if (i < 0)
+		i = scrypt_prefetch;
+	if (i >= SCRYPT_PREFETCH_MODES)
+		return NULL;
+	return scrypt_prefetch_names[i];
+}
+
+/* whether the default kernel has prefetches the hint can change */
+bool scrypt_prefetch_tunable(void)
+{
+	if (!scrypt_kernel)
+		scrypt_set_kernel(NULL);
+	if (scrypt_kernel->pipe[0])
+		return scrypt_kernel->pipe[0] != scrypt_kernel->pipe[SCRYPT_PREFETCH_OFF];
+	return scrypt_kernel->core[0] != scrypt_kernel->core[SCRYPT_PREFETCH_OFF];
+}
+
+/* whether scanhash_scrypt() keeps a batch in flight between calls, see work->next_nonce */
+bool scrypt_pipelined(int forceThroughput)
+{
+	if (!scrypt_kernel)
+		scrypt_set_kernel(NULL);
+	return forceThroughput == -1 && scrypt_kernel->pipe[0];
+}
+
+bool scrypt_set_layout(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(scrypt_layout_names); i++) {
+		if (!strcasecmp(name, scrypt_layout_names[i])) {
+			scrypt_v_layout = i;
+			return true;
+		}
+	}
+	applog(LOG_ERR, "Unknown V layout '%s' (available: interleave stagger contig, "
+		"each also with -nt)", name);
+	return false;
+}
+
+/* name of V layout i, or of the current one if i < 0 */
+const char *scrypt_layout_name(int i)
+{
+	if (i < 0)
+		i = scrypt_v_layout;
+	if (i >= ARRAY_SIZE(scrypt_layout_names))
+		return NULL;
+	return scrypt_layout_names[i];
+}
+
+/* whether the default kernel follows scrypt_set_layout() */
+bool scrypt_layout_tunable(void)
+{
+	if (!scrypt_kernel)
+		scrypt_set_kernel(NULL);
+	return scrypt_kernel->layouts;
+}
+
+/*
+ * ROMix is run in chunks of this many iterations, with the thread's
+ * restart flag checked in between: a new job drops the batch within a
+ * sixteenth of either loop rather than at its end.
+ */
+static inline int scrypt_chunk(int N)
+{
+	return N >= 16 ? N / 16 : N;
+}
+
+/* kernel k's ROMix on X with prefetch hint pf, false if *stop was raised first */
+static bool scrypt_romix(const struct scrypt_kernel *k, int pf, uint32_t *X, uint32_t *V,
+	int N, const volatile uint8_t *stop)
+{
+	int i, step = k->whole ? 2 * N : scrypt_chunk(N);
+
+	for (i = 0; i < 2 * N; i += step) {
+		if (stop && unlikely(*stop))
+			return false;
+		k->core[pf](X, V, N, i, i + step);
+	}
+	return true;
+}
+
+#ifdef HAVE_SCRYPT_PIPE
+/* one pipe() round on slot "which", chunked as above */
+static bool scrypt_romix_pipe(const struct scrypt_kernel *k, int pf, uint32_t *X, uint32_t *V,
+	int N, int which, const volatile uint8_t *stop)
+{
+	int i, step = scrypt_chunk(N);
+
+	for (i = 0; i < N; i += step) {
+		if (stop && unlikely(*stop))
+			return false;
+		k->pipe[pf](X, V, N, which, i, i + step);
+	}
+	return true;
+}
+#endif
+
+/*
+ * Seconds taken by "calls" ROMix rounds of a default thread over an
+ * N-block scratchpad with prefetch hint i, on the calling thread.
+ */
+double scrypt_core_time(unsigned char *scratchbuf, int N, int i, int calls)
+{
+	uint32_t _ALIGN(128) X[SCRYPT_MAX_WAYS * 32];
+	uint32_t *V = (uint32_t *)(((uintptr_t)(scratchbuf) + 63) & ~ (uintptr_t)(63));
+	const struct scrypt_kernel *k;
+	struct timeval start, end, diff;
+	int c, n;
+
+	for (n = 0; n < SCRYPT_MAX_WAYS * 32; n++)
+		X[n] = n * 0x9e3779b9;
+
+	if (!scrypt_kernel)
+		scrypt_set_kernel(NULL);
+	k = scrypt_kernel;
+	gettimeofday(&start, NULL);
+	for (c = 0; c < calls; c++) {
+#ifdef HAVE_SCRYPT_PIPE
+		if (k->pipe[0]) {
+			scrypt_romix_pipe(k, i, X, V, N, c & 1, NULL);
+			continue;
+		}
+#endif
+		/* one kernel call per ways lanes, like the scanhash wrappers */
+		for (n = 0; n + k->ways <= scrypt_lanes; n += k->ways)
+			scrypt_romix(k, i, X + n * 32, V, N, NULL);
+	}
+	gettimeofday(&end, NULL);
+	timeval_subtract(&diff, &end, &start);
+	return diff.tv_sec + diff.tv_usec * 1e-6;
+}
+
+static pthread_mutex_t alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool tested_hugepages = false;
+static bool disable_hugepages = false;
+
+/*
+ * Page sizes a scratchpad can end up on, best first. With 128 MiB per
+ * lane read at random, every step down costs TLB misses.
+ */
+enum scrypt_pages {
+	SCRYPT_PAGES_1G,
+	SCRYPT_PAGES_2M,
+	SCRYPT_PAGES_THP,	/* madvise(MADV_HUGEPAGE), up to khugepaged */
+	SCRYPT_PAGES_4K,
+	SCRYPT_PAGES_KINDS
+};
+
+static const char *scrypt_pages_names[SCRYPT_PAGES_KINDS] = { "1G", "2M", "THP", "4K" };
+
+/* per page kind: scratchpads handed out on it, and tries that failed */
+static int scrypt_pages_placed[SCRYPT_PAGES_KINDS];
+static int scrypt_pages_failed[SCRYPT_PAGES_KINDS];
+
+/*
+ * Every scratchpad starts with a small header recording how it was
+ * obtained, so scrypt_buffer_free() can hand it back the same way.
+ * The header keeps the buffer itself 64-byte aligned.
+ */
+#define SCRYPT_BUFFER_HEADER 64
+
+enum scrypt_buffer_kind {
+	SCRYPT_BUFFER_MALLOC,
+	SCRYPT_BUFFER_MMAP,
+	SCRYPT_BUFFER_VIRTUALALLOC,
+	SCRYPT_BUFFER_ARENA	/* a slice of the arena, see scrypt_arena_reserve() */
+};
+
+struct scrypt_buffer_header {
+	size_t size;
+	int kind;
+	int pages;
+	int node;	/* NUMA node it was bound to, -1 if none */
+};
+
+static unsigned char *scrypt_buffer_tag(unsigned char *base, size_t size, int kind, int pages)
+{
+	struct scrypt_buffer_header *hdr = (struct scrypt_buffer_header *)base;
+
+	if (!base)
+		return NULL;
+	hdr->size = size;
+	hdr->kind = kind;
+	hdr->pages = pages;
+	hdr->node = -1;
+#ifdef HAVE_SCRYPT_PIPE
+	/* no batch in flight yet */
+	if (size >= SCRYPT_BUFFER_HEADER + sizeof(struct scrypt_pipe_state))
+		memset(base + SCRYPT_BUFFER_HEADER, 0, sizeof(struct scrypt_pipe_state));
+#endif
+	return base + SCRYPT_BUFFER_HEADER;
+}
+
+static void scrypt_pages_count(int pages, int delta)
+{
+	pthread_mutex_lock(&alloc_mutex);
+	scrypt_pages_placed[pages] += delta;
+	pthread_mutex_unlock(&alloc_mutex);
+}
+
+static void scrypt_pages_fail(int pages)
+{
+	pthread_mutex_lock(&alloc_mutex);
+	scrypt_pages_failed[pages]++;
+	pthread_mutex_unlock(&alloc_mutex);
+}
+
+static unsigned char *scrypt_buffer_node(unsigned char *scratchbuf, int node)
+{
+	if (scratchbuf)
+		((struct scrypt_buffer_header *)(scratchbuf - SCRYPT_BUFFER_HEADER))->node = node;
+	return scratchbuf;
+}
+
+#ifdef __linux__
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define SCRYPT_2M (2UL << 20)
+#define SCRYPT_1G (1UL << 30)
+
+/* what the host offers, read once */
+static bool scrypt_have_1g = false;
+static bool scrypt_have_thp = false;
+
+static long scrypt_sysfs_long(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	long v = 0;
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "%ld", &v) != 1)
+		v = 0;
+	fclose(f);
+	return v;
+}
+
+static void scrypt_pages_probe(void)
+{
+	char buff[64] = { 0 };
+	FILE *f;
+
+	scrypt_have_1g = scrypt_sysfs_long("/sys/kernel/mm/hugepages/hugepages-1048576kB/nr_hugepages") > 0;
+	f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (f) {
+		if (fread(buff, 1, sizeof(buff) - 1, f) > 0)
+			scrypt_have_thp = strstr(buff, "[always]") || strstr(buff, "[madvise]");
+		fclose(f);
+	}
+	applog(LOG_DEBUG, "HugePages: 1G pool %s, THP %s", scrypt_have_1g ? "yes" : "no",
+		scrypt_have_thp ? "yes" : "no");
+}
+
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT 0
+#define MPOL_PREFERRED 1
+#define MPOL_BIND 2
+#endif
+
+/* node masks for the raw mempolicy syscalls, no libnuma needed */
+#define SCRYPT_NODE_BITS 1024
+
+static void scrypt_node_mask(unsigned long *mask, int node)
+{
+	const int bits = 8 * sizeof(long);
+
+	memset(mask, 0, SCRYPT_NODE_BITS / 8);
+	mask[node / bits] |= 1UL << (node % bits);
+}
+
+/* the calling thread's policy: MPOL_BIND to node, or back to MPOL_DEFAULT */
+static void scrypt_thread_mempolicy(int mode, int node)
+{
+	unsigned long mask[SCRYPT_NODE_BITS / (8 * sizeof(long))];
+
+	if (mode == MPOL_DEFAULT) {
+		syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+		return;
+	}
+	scrypt_node_mask(mask, node);
+	syscall(SYS_set_mempolicy, mode, mask, SCRYPT_NODE_BITS + 1);
+}
+
+/* prefer node for pages of [p, p + size) not faulted in yet */
+static void scrypt_mbind_preferred(void *p, size_t size, int node)
+{
+	unsigned long mask[SCRYPT_NODE_BITS / (8 * sizeof(long))];
+
+	scrypt_node_mask(mask, node);
+	syscall(SYS_mbind, p, size, MPOL_PREFERRED, mask, SCRYPT_NODE_BITS + 1, 0);
+}
+
+/*
+ * The hugetlb pool is split per node. Under MPOL_BIND the reservation
+ * made by mmap only counts free pages of that node, so a node that ran
+ * out fails here instead of handing out remote pages; the mapping itself
+ * is then bound to the node, for whichever thread faults it in. The pages
+ * are reserved by mmap but not faulted in, see scrypt_arena_prefault().
+ */
+static unsigned char *scrypt_mmap_hugetlb(size_t size, int flags, int node)
+{
+	unsigned long mask[SCRYPT_NODE_BITS / (8 * sizeof(long))];
+	void *m;
+
+	if (node >= 0)
+		scrypt_thread_mempolicy(MPOL_BIND, node);
+	m = mmap(0, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | flags, -1, 0);
+	if (node >= 0) {
+		scrypt_thread_mempolicy(MPOL_DEFAULT, 0);
+		if (m != MAP_FAILED) {
+			scrypt_node_mask(mask, node);
+			syscall(SYS_mbind, m, size, MPOL_BIND, mask, SCRYPT_NODE_BITS + 1, 0);
+		}
+	}
+	return m == MAP_FAILED ? NULL : (unsigned char *) m;
+}
+
+/* normal pages, 2 MiB aligned and advised, so THP can back all of it */
+static unsigned char *scrypt_mmap_thp(size_t size)
+{
+	unsigned char *m, *p;
+	size_t head;
+
+	m = (unsigned char *) mmap(0, size + SCRYPT_2M, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED)
+		return NULL;
+	p = (unsigned char *) (((uintptr_t) m + SCRYPT_2M - 1) & ~(uintptr_t) (SCRYPT_2M - 1));
+	head = p - m;
+	if (head)
+		munmap(m, head);
+	munmap(p + size, SCRYPT_2M - head);
+	if (madvise(p, size, MADV_HUGEPAGE)) {
+		munmap(p, size);
+		return NULL;
+	}
+	return p;
+}
+#endif
+
+/* bytes a scratchpad for the current kernel needs, header included */
+static size_t scrypt_buffer_size(int N, int forceThroughput)
+{
+	if (!scrypt_kernel)
+		scrypt_set_kernel(NULL);
+	uint32_t throughput = (forceThroughput == -1 ? scrypt_kernel->ways : forceThroughput);
+	const struct scrypt_kernel *k = forceThroughput == 1 ? scrypt_kernel_1way : scrypt_kernel;
+	int blocks = N;
+
+	if (k->core[0] == scrypt_core_tmto)
+		blocks = N / scrypt_tmto;
+
+	size_t size = (size_t) throughput * 32 * (blocks + 1) * sizeof(uint32_t) + SCRYPT_BUFFER_HEADER;
+	/* a staggered V needs a bit more */
+	if (k->layouts)
+		size += scrypt_layout_bytes(throughput, blocks) - (size_t) throughput * 32 * blocks * sizeof(uint32_t);
+#ifdef HAVE_SCRYPT_PIPE
+	if (forceThroughput == -1 && scrypt_kernel->pipe[0])
+		size += sizeof(struct scrypt_pipe_state);
+#endif
+	return size;
+}
+
+/*
+ * size bytes on the best pages available, on NUMA node node (-1: any).
+ * Used for the arena regions and for one-off scratchpads.
+ */
+static unsigned char *scrypt_region_alloc(size_t size, int node)
+{
+#ifdef __linux__
+	size_t size_1g = (size + SCRYPT_1G - 1) & ~(SCRYPT_1G - 1);
+	size_t size_2m = (size + SCRYPT_2M - 1) & ~(SCRYPT_2M - 1);
+	unsigned char *m;
+
+	pthread_mutex_lock(&alloc_mutex);
+	if (!tested_hugepages) {
+		scrypt_pages_probe();
+		tested_hugepages = true;
+	}
+	pthread_mutex_unlock(&alloc_mutex);
+
+	/*
+	 * 1 GiB pages only when rounding up wastes at most a quarter of the
+	 * scratchpad, smaller ones are better served by the 2 MiB pool.
+	 */
+	if (scrypt_have_1g && size_1g - size <= size / 4) {
+		m = scrypt_mmap_hugetlb(size_1g, MAP_HUGE_1GB, node);
+		if (m)
+			return scrypt_buffer_node(scrypt_buffer_tag(m, size_1g, SCRYPT_BUFFER_MMAP, SCRYPT_PAGES_1G), node);
+		scrypt_pages_fail(SCRYPT_PAGES_1G);
+	}
+	if (!disable_hugepages) {
+		m = scrypt_mmap_hugetlb(size_2m, MAP_HUGE_2MB, node);
+		if (m)
+			return scrypt_buffer_node(scrypt_buffer_tag(m, size_2m, SCRYPT_BUFFER_MMAP, SCRYPT_PAGES_2M), node);
+		pthread_mutex_lock(&alloc_mutex);
+		scrypt_pages_failed[SCRYPT_PAGES_2M]++;
+		if (!scrypt_pages_placed[SCRYPT_PAGES_2M] && node < 0) {
+			/* no 2 MiB pool at all, do not retry for every thread */
+			applog(LOG_DEBUG, "HugePages unavailable (%d)", errno);
+			disable_hugepages = true;
+		} else {
+			applog(LOG_INFO, "HugePages too small! (%d success, %d fail)\n\tNeed at most %lu more hugepages",
+				scrypt_pages_placed[SCRYPT_PAGES_2M], scrypt_pages_failed[SCRYPT_PAGES_2M],
+				(unsigned long) (size_2m / SCRYPT_2M));
+		}
+		pthread_mutex_unlock(&alloc_mutex);
+	}
+	/* a local THP scratchpad beats remote hugetlb pages */
+	if (scrypt_have_thp) {
+		m = scrypt_mmap_thp(size_2m);
+		if (m) {
+			if (node >= 0)
+				scrypt_mbind_preferred(m, size_2m, node);
+			return scrypt_buffer_node(scrypt_buffer_tag(m, size_2m, SCRYPT_BUFFER_MMAP, SCRYPT_PAGES_THP), node);
+		}
+		scrypt_pages_fail(SCRYPT_PAGES_THP);
+	}
+	m = (unsigned char *) mmap(0, size_2m, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED)
+		return NULL;
+	if (node >= 0)
+		scrypt_mbind_preferred(m, size_2m, node);
+	return scrypt_buffer_node(scrypt_buffer_tag(m, size_2m, SCRYPT_BUFFER_MMAP, SCRYPT_PAGES_4K), node);
+#elif defined(WIN32)
+
+	pthread_mutex_lock(&alloc_mutex);
+	if (!tested_hugepages)
+	{
+		tested_hugepages = true;
+		
+		HANDLE           hToken;
+		TOKEN_PRIVILEGES tp;
+		BOOL             status;
+
+		if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+			disable_hugepages = true;
+
+		if (!disable_hugepages && !LookupPrivilegeValue(NULL, TEXT("SeLockMemoryPrivilege"), &tp.Privileges[0].Luid))
+			disable_hugepages = true;
+
+		if (!disable_hugepages)
+		{
+			tp.PrivilegeCount = 1;
+			tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+			status = AdjustTokenPrivileges(hToken, FALSE, &tp, 0, (PTOKEN_PRIVILEGES)NULL, 0);
+		}
+
+		if (disable_hugepages || (!status || (GetLastError() != ERROR_SUCCESS)))
+		{
+			applog(LOG_DEBUG, "HugePages: not enabled, view readme for more info!");
+			disable_hugepages = true;
+		}
+
+		CloseHandle(hToken);
+	}
+	pthread_mutex_unlock(&alloc_mutex);
+
+	if (tested_hugepages && !disable_hugepages)
+	{   
+		SIZE_T iLargePageMin = GetLargePageMinimum();
+		/* VirtualAlloc wants a multiple of the large page size */
+		size = (size + iLargePageMin - 1) & ~(iLargePageMin - 1);
+
+		unsigned char *scratchpad = VirtualAllocEx(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (scratchpad)
+			return scrypt_buffer_tag(scratchpad, size, SCRYPT_BUFFER_VIRTUALALLOC, SCRYPT_PAGES_2M);
+		applog(LOG_ERR, "Large page allocation failed.");
+		scrypt_pages_fail(SCRYPT_PAGES_2M);
+		scratchpad = VirtualAllocEx(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		return scrypt_buffer_tag(scratchpad, size, SCRYPT_BUFFER_VIRTUALALLOC, SCRYPT_PAGES_4K);
+	}
+	else
+	{
+		return scrypt_buffer_tag((unsigned char*)malloc(size), size, SCRYPT_BUFFER_MALLOC, SCRYPT_PAGES_4K);
+	}
+
+#else
+	return scrypt_buffer_tag((unsigned char*)malloc(size), size, SCRYPT_BUFFER_MALLOC, SCRYPT_PAGES_4K);
+#endif
+}
+
+static void scrypt_region_free(unsigned char *scratchbuf)
+{
+	struct scrypt_buffer_header *hdr;
+
+	if (!scratchbuf)
+		return;
+	hdr = (struct scrypt_buffer_header *)(scratchbuf - SCRYPT_BUFFER_HEADER);
+	switch (hdr->kind) {
+#ifdef __linux__
+	case SCRYPT_BUFFER_MMAP:
+		munmap(hdr, hdr->size);
+		break;
+#endif
+#ifdef WIN32
+	case SCRYPT_BUFFER_VIRTUALALLOC:
+		VirtualFreeEx(GetCurrentProcess(), hdr, 0, MEM_RELEASE);
+		break;
+#endif
+	default:
+		free(hdr);
+		break;
+	}
+}
+
+/* a scratchpad of its own, for benchmarks and tests; miners use the arena */
+unsigned char *scrypt_buffer_alloc(int N, int forceThroughput)
+{
+	/* threads confined to one node get their scratchpad there */
+	unsigned char *scratchbuf = scrypt_region_alloc(scrypt_buffer_size(N, forceThroughput),
+		numa_thread_node());
+
+	if (scratchbuf)
+		scrypt_pages_count(((struct scrypt_buffer_header *)(scratchbuf - SCRYPT_BUFFER_HEADER))->pages, 1);
+	return scratchbuf;
+}
+
+static void scrypt_arena_put(unsigned char *scratchbuf);
+
+/* gives back scrypt_buffer_alloc() and scrypt_arena_slice() scratchpads alike */
+void scrypt_buffer_free(unsigned char *scratchbuf)
+{
+	struct scrypt_buffer_header *hdr;
+
+	if (!scratchbuf)
+		return;
+	hdr = (struct scrypt_buffer_header *)(scratchbuf - SCRYPT_BUFFER_HEADER);
+	scrypt_pages_count(hdr->pages, -1);
+	if (hdr->kind == SCRYPT_BUFFER_ARENA)
+		scrypt_arena_put(scratchbuf);
+	else
+		scrypt_region_free(scratchbuf);
+}
+
+/* page kind a scratchpad ended up on: "1G", "2M", "THP" or "4K" */
+const char *scrypt_buffer_pages(const unsigned char *scratchbuf)
+{
+	const struct scrypt_buffer_header *hdr;
+
+	if (!scratchbuf)
+		return "none";
+	hdr = (const struct scrypt_buffer_header *)(scratchbuf - SCRYPT_BUFFER_HEADER);
+	return scrypt_pages_names[hdr->pages];
+}
+
+/*
+ * Where the pages of a scratchpad are: *node is the node it was bound to
+ * (or, for a thread free to roam, the one it runs on now), and the
+ * result the share of sampled pages on that node in percent, -1 if
+ * none of them has been faulted in yet or NUMA does not apply.
+ */
+int scrypt_buffer_numa(const unsigned char *scratchbuf, int *node)
+{
+	*node = -1;
+#ifdef __linux__
+	const struct scrypt_buffer_header *hdr;
+	void *pages[64];
+	int status[64], n, i, resident = 0, local = 0;
+	unsigned cpu, cur;
+
+	if (!scratchbuf || numa_node_count() < 2)
+		return -1;
+	hdr = (const struct scrypt_buffer_header *)(scratchbuf - SCRYPT_BUFFER_HEADER);
+	*node = hdr->node;
+	if (*node < 0 && !syscall(SYS_getcpu, &cpu, &cur, NULL))
+		*node = cur;
+	n = hdr->size / 4096 < 64 ? hdr->size / 4096 : 64;
+	for (i = 0; i < n; i++)
+		pages[i] = (unsigned char *) hdr + (hdr->size / n) * i / 4096 * 4096;
+	/* no target nodes: only reports where each page is */
+	if (syscall(SYS_move_pages, 0, n, pages, NULL, status, 0))
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (status[i] < 0)
+			continue;
+		resident++;
+		local += status[i] == *node;
+	}
+	return resident ? 100 * local / resident : -1;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * "1G:1/0,2M:3/1,THP:0/0,4K:0/0": scratchpads currently on each page
+ * kind, and how many tries of that kind failed so far.
+ */
+void scrypt_pages_report(char *buf, size_t len)
+{
+	size_t n = 0;
+	int i;
+
+	*buf = '\0';
+	pthread_mutex_lock(&alloc_mutex);
+	for (i = 0; i < SCRYPT_PAGES_KINDS && n < len; i++)
+		n += snprintf(buf + n, len - n, "%s%s:%d/%d", i ? "," : "",
+			scrypt_pages_names[i], scrypt_pages_placed[i], scrypt_pages_failed[i]);
+	pthread_mutex_unlock(&alloc_mutex);
+}
+
+/*
+ * Scratchpad arena. The mining threads' scratchpads are reserved in one
+ * go before the threads start, one region per NUMA node in use, and
+ * carved into 2 MiB aligned slices, one per thread. What mining needs is
+ * then known up front, nothing gets mapped while hashing, and the page
+ * tiers are tried once per region instead of by every thread racing for
+ * the hugepage pool. A new thread or lane count re-carves the regions in
+ * place when they are big enough, and replaces them otherwise; a job
+ * with a bigger N moves the threads off it, see scrypt_buffer_resize().
+ */
+#define SCRYPT_ARENA_ALIGN (2UL << 20)
+#define SCRYPT_ARENA_REGIONS 64
+
+struct scrypt_arena_slice {
+	unsigned char *base;	/* the slice header goes here */
+	size_t size;
+	int region;
+	bool used;
+	bool prefaulting;	/* prefault is still to be joined */
+	pthread_t prefault;
+};
+
+static struct {
+	unsigned char *region[SCRYPT_ARENA_REGIONS];	/* from scrypt_region_alloc() */
+	size_t region_size[SCRYPT_ARENA_REGIONS];	/* bytes the slices can use */
+	int region_node[SCRYPT_ARENA_REGIONS];
+	int regions;
+	struct scrypt_arena_slice *slice;
+	int slices;
+	size_t carved;
+	int prefault_left;	/* these two under prefault_mutex */
+	struct timeval prefault_start;
+} scrypt_arena;
+
+/*
+ * The pre-fault threads only take this one, so they can be joined with
+ * alloc_mutex held: the used check, the joins and the unmapping of a
+ * release then happen in one go, and no thread takes a slice or joins
+ * its pre-fault in between.
+ */
+static pthread_mutex_t prefault_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned char *scrypt_arena_start(int r)
+{
+	return (unsigned char *) (((uintptr_t) scrypt_arena.region[r] + SCRYPT_ARENA_ALIGN - 1)
+		& ~(uintptr_t) (SCRYPT_ARENA_ALIGN - 1));
+}
+
+static int scrypt_arena_used(void)
+{
+	int i, used = 0;
+
+	for (i = 0; i < scrypt_arena.slices; i++)
+		used += scrypt_arena.slice[i].used;
+	return used;
+}
+
+/* waits for the pre-fault of slice i, if one was started; alloc_mutex held */
+static void scrypt_arena_join(int i)
+{
+	struct scrypt_arena_slice *slice = &scrypt_arena.slice[i];
+
+	if (slice->prefaulting) {
+		pthread_join(slice->prefault, NULL);
+		slice->prefaulting = false;
+	}
+}
+
+/* scrypt_arena_release() with alloc_mutex held */
+static bool scrypt_arena_release_locked(void)
+{
+	int r;
+
+	if (scrypt_arena_used()) {
+		applog(LOG_ERR, "Scratchpad arena still in use, not released");
+		return false;
+	}
+	for (r = 0; r < scrypt_arena.slices; r++)
+		scrypt_arena_join(r);
+	for (r = 0; r < scrypt_arena.regions; r++)
+		scrypt_region_free(scrypt_arena.region[r]);
+	free(scrypt_arena.slice);
+	memset(&scrypt_arena, 0, sizeof(scrypt_arena));
+	return true;
+}
+
+/* unmaps the regions; false while a thread still holds its slice */
+bool scrypt_arena_release(void)
+{
+	bool released;
+
+	pthread_mutex_lock(&alloc_mutex);
+	released = scrypt_arena_release_locked();
+	pthread_mutex_unlock(&alloc_mutex);
+	return released;
+}
+
+/*
+ * Scratchpads for threads threads with the current kernel and N:
+ * forceThroughput[i] is what thread i passes to scanhash_scrypt(),
+ * node[i] the NUMA node it runs on or -1. Call it with no slice taken.
+ */
+bool scrypt_arena_reserve(int N, int threads, const int *forceThroughput, const int *node)
+{
+	struct scrypt_arena_slice *slice;
+	size_t need[SCRYPT_ARENA_REGIONS] = { 0 }, offset[SCRYPT_ARENA_REGIONS] = { 0 };
+	int nodes[SCRYPT_ARENA_REGIONS], regions = 0;
+	bool fits;
+	int i, r;
+
+	slice = (struct scrypt_arena_slice *) calloc(threads, sizeof(*slice));
+	if (!slice)
+		return false;
+	for (i = 0; i < threads; i++) {
+		for (r = 0; r < regions && nodes[r] != node[i]; r++)
+			;
+		if (r == regions) {
+			if (regions == SCRYPT_ARENA_REGIONS) {
+				free(slice);
+				return false;
+			}
+			nodes[regions++] = node[i];
+		}
+		slice[i].size = (scrypt_buffer_size(N, forceThroughput[i]) + SCRYPT_ARENA_ALIGN - 1)
+			& ~(SCRYPT_ARENA_ALIGN - 1);
+		slice[i].region = r;
+		need[r] += slice[i].size;
+	}
+
+	fits = regions == scrypt_arena.regions;
+	for (r = 0; fits && r < regions; r++)
+		fits = nodes[r] == scrypt_arena.region_node[r] && need[r] <= scrypt_arena.region_size[r];
+	if (fits) {
+		pthread_mutex_lock(&alloc_mutex);
+		if (scrypt_arena_used()) {
+			pthread_mutex_unlock(&alloc_mutex);
+			free(slice);
+			applog(LOG_ERR, "Scratchpad arena still in use, cannot re-carve it");
+			return false;
+		}
+		for (i = 0; i < scrypt_arena.slices; i++)
+			scrypt_arena_join(i);
+		free(scrypt_arena.slice);
+		applog(LOG_DEBUG, "Scratchpad arena: re-carved in place for %d threads", threads);
+	} else {
+		if (!scrypt_arena_release()) {
+			free(slice);
+			return false;
+		}
+		for (r = 0; r < regions; r++) {
+			/* room to align the first slice */
+			scrypt_arena.region[r] = scrypt_region_alloc(need[r] + SCRYPT_ARENA_ALIGN, nodes[r]);
+			if (!scrypt_arena.region[r]) {
+				pthread_mutex_lock(&alloc_mutex);
+				scrypt_arena.regions = r;
+				scrypt_arena_release_locked();
+				pthread_mutex_unlock(&alloc_mutex);
+				free(slice);
+				return false;
+			}
+			scrypt_arena.region_size[r] = need[r];
+			scrypt_arena.region_node[r] = nodes[r];
+			applog(LOG_INFO, "Scratchpad arena: %lu MiB on %s pages%s",
+				(unsigned long) (need[r] >> 20),
+				scrypt_buffer_pages(scrypt_arena.region[r]),
+				nodes[r] >= 0 ? ", bound to its NUMA node" : "");
+		}
+		pthread_mutex_lock(&alloc_mutex);
+		scrypt_arena.regions = regions;
+	}
+	scrypt_arena.carved = 0;
+	for (i = 0; i < threads; i++) {
+		r = slice[i].region;
+		slice[i].base = scrypt_arena_start(r) + offset[r];
+		offset[r] += slice[i].size;
+		scrypt_arena.carved += slice[i].size;
+	}
+	scrypt_arena.slice = slice;
+	scrypt_arena.slices = threads;
+	pthread_mutex_unlock(&alloc_mutex);
+	return true;
+}
+
+static void *scrypt_prefault_thread(void *userdata)
+{
+	struct scrypt_arena_slice *slice = (struct scrypt_arena_slice *) userdata;
+	struct timeval now, diff;
+	size_t off;
+
+	/* one write per 4 KiB page faults in any page size */
+	for (off = 0; off < slice->size; off += 4096)
+		((volatile unsigned char *) slice->base)[off] = 0;
+
+	pthread_mutex_lock(&prefault_mutex);
+	if (!--scrypt_arena.prefault_left) {
+		gettimeofday(&now, NULL);
+		timeval_subtract(&diff, &now, &scrypt_arena.prefault_start);
+		applog(LOG_INFO, "Scratchpads ready, pre-faulted in %.2fs by %d threads",
+			diff.tv_sec + diff.tv_usec * 1e-6, scrypt_arena.slices);
+	}
+	pthread_mutex_unlock(&prefault_mutex);
+	return NULL;
+}
+
+/*
+ * Faults all the slices in, one thread each, and returns at once: the
+ * page zeroing of several GiB then runs on all cores while the pool
+ * connection is set up, instead of stalling each miner thread's first
+ * hash. scrypt_arena_slice() waits for its slice to be done.
+ */
+void scrypt_arena_prefault(void)
+{
+	int i;
+
+	pthread_mutex_lock(&alloc_mutex);
+	/* held until all are started, so none counts down from a partial total */
+	pthread_mutex_lock(&prefault_mutex);
+	gettimeofday(&scrypt_arena.prefault_start, NULL);
+	scrypt_arena.prefault_left = scrypt_arena.slices;
+	for (i = 0; i < scrypt_arena.slices; i++) {
+		struct scrypt_arena_slice *slice = &scrypt_arena.slice[i];
+		if (slice->prefaulting || slice->used ||
+		    pthread_create(&slice->prefault, NULL, scrypt_prefault_thread, slice)) {
+			/* the miner thread faults it in itself */
+			scrypt_arena.prefault_left--;
+			continue;
+		}
+		slice->prefaulting = true;
+	}
+	pthread_mutex_unlock(&prefault_mutex);
+	pthread_mutex_unlock(&alloc_mutex);
+}
+
+/* thread thr_id's scratchpad, give it back with scrypt_buffer_free() */
+unsigned char *scrypt_arena_slice(int thr_id)
+{
+	const struct scrypt_buffer_header *region;
+	struct scrypt_arena_slice *slice;
+	unsigned char *scratchbuf;
+
+	pthread_mutex_lock(&alloc_mutex);
+	if (thr_id < 0 || thr_id >= scrypt_arena.slices || scrypt_arena.slice[thr_id].used) {
+		pthread_mutex_unlock(&alloc_mutex);
+		return NULL;
+	}
+	scrypt_arena_join(thr_id);
+	slice = &scrypt_arena.slice[thr_id];
+	slice->used = true;
+	region = (const struct scrypt_buffer_header *)(scrypt_arena.region[slice->region] - SCRYPT_BUFFER_HEADER);
+	scratchbuf = scrypt_buffer_tag(slice->base, slice->size, SCRYPT_BUFFER_ARENA, region->pages);
+	scrypt_buffer_node(scratchbuf, region->node);
+	scrypt_pages_placed[region->pages]++;
+	pthread_mutex_unlock(&alloc_mutex);
+	return scratchbuf;
+}
+
+static void scrypt_arena_put(unsigned char *scratchbuf)
+{
+	int i;
+
+	pthread_mutex_lock(&alloc_mutex);
+	for (i = 0; i < scrypt_arena.slices; i++)
+		if (scrypt_arena.slice[i].base + SCRYPT_BUFFER_HEADER == scratchbuf)
+			scrypt_arena.slice[i].used = false;
+	pthread_mutex_unlock(&alloc_mutex);
+}
+
+/*
+ * Scratchpad for jobs with N: scratchbuf itself while it is big enough,
+ * a scrypt_buffer_alloc() one otherwise. Threads move over one at a time
+ * as they pick up such a job, so the slices they leave stay mapped until
+ * the last one is given back, and the arena goes away then.
+ */
+unsigned char *scrypt_buffer_resize(unsigned char *scratchbuf, int N, int forceThroughput)
+{
+	const struct scrypt_buffer_header *hdr;
+	bool slice;
+
+	if (!scratchbuf)
+		return scrypt_buffer_alloc(N, forceThroughput);
+	hdr = (const struct scrypt_buffer_header *)(scratchbuf - SCRYPT_BUFFER_HEADER);
+	if (hdr->size >= scrypt_buffer_size(N, forceThroughput))
+		return scratchbuf;
+	slice = hdr->kind == SCRYPT_BUFFER_ARENA;
+	scrypt_buffer_free(scratchbuf);
+	if (slice) {
+		/* checked and released in one go, a second thread finds it gone */
+		pthread_mutex_lock(&alloc_mutex);
+		if (!scrypt_arena_used())
+			scrypt_arena_release_locked();
+		pthread_mutex_unlock(&alloc_mutex);
+	}
+	return scrypt_buffer_alloc(N, forceThroughput);
+}
+
+/* "3082/3084,4/4": MiB carved into slices / reserved, slices taken / carved */
+void scrypt_arena_report(char *buf, size_t len)
+{
+	size_t reserved = 0;
+	int r;
+
+	pthread_mutex_lock(&alloc_mutex);
+	for (r = 0; r < scrypt_arena.regions; r++)
+		reserved += scrypt_arena.region_size[r];
+	snprintf(buf, len, "%lu/%lu,%d/%d", (unsigned long) (scrypt_arena.carved >> 20),
+		(unsigned long) (reserved >> 20), scrypt_arena_used(), scrypt_arena.slices);
+	pthread_mutex_unlock(&alloc_mutex);
+}
+
+static bool scrypt_1024_1_1_256(const uint32_t *input, uint32_t *output,
+	uint32_t *midstate, unsigned char *scratchpad, int N, const volatile uint8_t *stop)
+{
 	uint32_t tstate[8], ostate[8];
 	uint32_t X[32];
 	uint32_t *V;
@@ -1922,14 +3527,41 @@ static void scrypt_1024_1_1_256(const uint32_t *input, uint32_t *output,
 	HMAC_SHA256_80_init(input, tstate, ostate);
 	PBKDF2_SHA256_80_128(tstate, ostate, input, X);
 
-	scrypt_core(X, V, N);
+	if (!scrypt_romix(scrypt_kernel_1way, scrypt_prefetch, X, V, N, stop))
+		return false;
 
 	PBKDF2_SHA256_128_32(tstate, ostate, X, output);
+	return true;
+}
+
+/* one call of a kernel of any other width */
+static bool scrypt_1024_1_1_256_nway(const uint32_t *input, uint32_t *output,
+	uint32_t *midstate, unsigned char *scratchpad, int N, int ways, const volatile uint8_t *stop)
+{
+	uint32_t _ALIGN(128) tstate[SCRYPT_MAX_WAYS * 8], ostate[SCRYPT_MAX_WAYS * 8];
+	uint32_t _ALIGN(128) X[SCRYPT_MAX_WAYS * 32];
+	uint32_t *V;
+	int i;
+
+	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (i = 0; i < ways; i++) {
+		memcpy(tstate + 8 * i, midstate, 32);
+		HMAC_SHA256_80_init(input + 20 * i, tstate + 8 * i, ostate + 8 * i);
+		PBKDF2_SHA256_80_128(tstate + 8 * i, ostate + 8 * i, input + 20 * i, X + 32 * i);
+	}
+
+	if (!scrypt_romix(scrypt_kernel, scrypt_prefetch, X, V, N, stop))
+		return false;
+
+	for (i = 0; i < ways; i++)
+		PBKDF2_SHA256_128_32(tstate + 8 * i, ostate + 8 * i, X + 32 * i, output + 8 * i);
+	return true;
 }
 
 #ifdef HAVE_SHA256_4WAY
-static void scrypt_1024_1_1_256_4way(const uint32_t *input,
-	uint32_t *output, uint32_t *midstate, unsigned char *scratchpad, int N)
+static bool scrypt_1024_1_1_256_4way(const uint32_t *input, uint32_t *output,
+	uint32_t *midstate, unsigned char *scratchpad, int N, const volatile uint8_t *stop)
 {
 	uint32_t _ALIGN(128) tstate[4 * 8];
 	uint32_t _ALIGN(128) ostate[4 * 8];
@@ -1951,10 +3583,9 @@ static void scrypt_1024_1_1_256_4way(const uint32_t *input,
 	for (i = 0; i < 32; i++)
 		for (k = 0; k < 4; k++)
 			X[k * 32 + i] = W[4 * i + k];
-	scrypt_core(X + 0 * 32, V, N);
-	scrypt_core(X + 1 * 32, V, N);
-	scrypt_core(X + 2 * 32, V, N);
-	scrypt_core(X + 3 * 32, V, N);
+	for (k = 0; k < 4; k++)
+		if (!scrypt_romix(scrypt_kernel_1way, scrypt_prefetch, X + k * 32, V, N, stop))
+			return false;
 	for (i = 0; i < 32; i++)
 		for (k = 0; k < 4; k++)
 			W[4 * i + k] = X[k * 32 + i];
@@ -1962,13 +3593,14 @@ static void scrypt_1024_1_1_256_4way(const uint32_t *input,
 	for (i = 0; i < 8; i++)
 		for (k = 0; k < 4; k++)
 			output[k * 8 + i] = W[4 * i + k];
+	return true;
 }
 #endif /* HAVE_SHA256_4WAY */
 
 #ifdef HAVE_SCRYPT_3WAY
 
-static void scrypt_1024_1_1_256_3way(const uint32_t *input,
-	uint32_t *output, uint32_t *midstate, unsigned char *scratchpad, int N)
+static bool scrypt_1024_1_1_256_3way(const uint32_t *input, uint32_t *output,
+	uint32_t *midstate, unsigned char *scratchpad, int N, const volatile uint8_t *stop)
 {
 	uint32_t _ALIGN(64) tstate[3 * 8], ostate[3 * 8];
 	uint32_t _ALIGN(64) X[3 * 32];
@@ -1986,16 +3618,18 @@ static void scrypt_1024_1_1_256_3way(const uint32_t *input,
 	PBKDF2_SHA256_80_128(tstate +  8, ostate +  8, input + 20, X + 32);
 	PBKDF2_SHA256_80_128(tstate + 16, ostate + 16, input + 40, X + 64);
 
-	scrypt_core_3way(X, V, N);
+	if (!scrypt_romix(scrypt_kernel, scrypt_prefetch, X, V, N, stop))
+		return false;
 
 	PBKDF2_SHA256_128_32(tstate +  0, ostate +  0, X +  0, output +  0);
 	PBKDF2_SHA256_128_32(tstate +  8, ostate +  8, X + 32, output +  8);
 	PBKDF2_SHA256_128_32(tstate + 16, ostate + 16, X + 64, output + 16);
+	return true;
 }
 
 #ifdef HAVE_SHA256_4WAY
-static void scrypt_1024_1_1_256_12way(const uint32_t *input,
-	uint32_t *output, uint32_t *midstate, unsigned char *scratchpad, int N)
+static bool scrypt_1024_1_1_256_12way(const uint32_t *input, uint32_t *output,
+	uint32_t *midstate, unsigned char *scratchpad, int N, const volatile uint8_t *stop)
 {
 	uint32_t _ALIGN(128) tstate[12 * 8];
 	uint32_t _ALIGN(128) ostate[12 * 8];
@@ -2024,10 +3658,9 @@ static void scrypt_1024_1_1_256_12way(const uint32_t *input,
 		for (i = 0; i < 32; i++)
 			for (k = 0; k < 4; k++)
 				X[128 * j + k * 32 + i] = W[128 * j + 4 * i + k];
-	scrypt_core_3way(X + 0 * 96, V, N);
-	scrypt_core_3way(X + 1 * 96, V, N);
-	scrypt_core_3way(X + 2 * 96, V, N);
-	scrypt_core_3way(X + 3 * 96, V, N);
+	for (j = 0; j < 4; j++)
+		if (!scrypt_romix(scrypt_kernel, scrypt_prefetch, X + j * 96, V, N, stop))
+			return false;
 	for (j = 0; j < 3; j++)
 		for (i = 0; i < 32; i++)
 			for (k = 0; k < 4; k++)
@@ -2039,14 +3672,15 @@ static void scrypt_1024_1_1_256_12way(const uint32_t *input,
 		for (i = 0; i < 8; i++)
 			for (k = 0; k < 4; k++)
 				output[32 * j + k * 8 + i] = W[128 * j + 4 * i + k];
+	return true;
 }
 #endif /* HAVE_SHA256_4WAY */
 
 #endif /* HAVE_SCRYPT_3WAY */
 
 #ifdef HAVE_SCRYPT_6WAY
-static void scrypt_1024_1_1_256_24way(const uint32_t *input,
-	uint32_t *output, uint32_t *midstate, unsigned char *scratchpad, int N)
+static bool scrypt_1024_1_1_256_24way(const uint32_t *input, uint32_t *output,
+	uint32_t *midstate, unsigned char *scratchpad, int N, const volatile uint8_t *stop)
 {
 	uint32_t _ALIGN(128) tstate[24 * 8];
 	uint32_t _ALIGN(128) ostate[24 * 8];
@@ -2075,10 +3709,9 @@ static void scrypt_1024_1_1_256_24way(const uint32_t *input,
 		for (i = 0; i < 32; i++)
 			for (k = 0; k < 8; k++)
 				X[8 * 32 * j + k * 32 + i] = W[8 * 32 * j + 8 * i + k];
-	scrypt_core_6way(X + 0 * 32, V, N);
-	scrypt_core_6way(X + 6 * 32, V, N);
-	scrypt_core_6way(X + 12 * 32, V, N);
-	scrypt_core_6way(X + 18 * 32, V, N);
+	for (j = 0; j < 4; j++)
+		if (!scrypt_romix(scrypt_kernel, scrypt_prefetch, X + j * 6 * 32, V, N, stop))
+			return false;
 	for (j = 0; j < 3; j++)
 		for (i = 0; i < 32; i++)
 			for (k = 0; k < 8; k++)
@@ -2090,9 +3723,203 @@ static void scrypt_1024_1_1_256_24way(const uint32_t *input,
 		for (i = 0; i < 8; i++)
 			for (k = 0; k < 8; k++)
 				output[8 * 8 * j + k * 8 + i] = W[8 * 32 * j + 8 * i + k];
+	return true;
 }
 #endif /* HAVE_SCRYPT_6WAY */
 
+#ifdef HAVE_SCRYPT_16WAY
+static bool scrypt_1024_1_1_256_16way(const uint32_t *input, uint32_t *output,
+	uint32_t *midstate, unsigned char *scratchpad, int N, const volatile uint8_t *stop)
+{
+	uint32_t _ALIGN(128) tstate[16 * 8];
+	uint32_t _ALIGN(128) ostate[16 * 8];
+	uint32_t _ALIGN(128) W[16 * 32];
+	uint32_t _ALIGN(128) X[16 * 32];
+	uint32_t *V;
+	int i, j, k;
+	
+	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+	
+	for (j = 0; j < 2; j++) 
+		for (i = 0; i < 20; i++)
+			for (k = 0; k < 8; k++)
+				W[8 * 32 * j + 8 * i + k] = input[8 * 20 * j + k * 20 + i];
+	for (j = 0; j < 2; j++)
+		for (i = 0; i < 8; i++)
+			for (k = 0; k < 8; k++)
+				tstate[8 * 8 * j + 8 * i + k] = midstate[i];
+	HMAC_SHA256_80_init_8way(W +   0, tstate +   0, ostate +   0);
+	HMAC_SHA256_80_init_8way(W + 256, tstate +  64, ostate +  64);
+	PBKDF2_SHA256_80_128_8way(tstate +   0, ostate +   0, W +   0, W +   0);
+	PBKDF2_SHA256_80_128_8way(tstate +  64, ostate +  64, W + 256, W + 256);
+	for (j = 0; j < 2; j++)
+		for (i = 0; i < 32; i++)
+			for (k = 0; k < 8; k++)
+				X[8 * 32 * j + k * 32 + i] = W[8 * 32 * j + 8 * i + k];
+	if (!scrypt_romix(scrypt_kernel, scrypt_prefetch, X, V, N, stop))
+		return false;
+	for (j = 0; j < 2; j++)
+		for (i = 0; i < 32; i++)
+			for (k = 0; k < 8; k++)
+				W[8 * 32 * j + 8 * i + k] = X[8 * 32 * j + k * 32 + i];
+	PBKDF2_SHA256_128_32_8way(tstate +   0, ostate +   0, W +   0, W +   0);
+	PBKDF2_SHA256_128_32_8way(tstate +  64, ostate +  64, W + 256, W + 256);
+	for (j = 0; j < 2; j++)
+		for (i = 0; i < 8; i++)
+			for (k = 0; k < 8; k++)
+				output[8 * 8 * j + k * 8 + i] = W[8 * 32 * j + 8 * i + k];
+	return true;
+}
+#endif /* HAVE_SCRYPT_16WAY */
+
+/*
+ * Lanes of a batch ending on nonce n that are in the range from first to
+ * max_nonce: the last claim of a job may end in the middle of a batch.
+ */
+static inline int scrypt_batch_lanes(uint32_t first, uint32_t n, uint32_t max_nonce, int lanes)
+{
+	return n - first > max_nonce - first ? lanes - (int) (n - max_nonce) : lanes;
+}
+
+/* records a winning nonce of the batch in work */
+static void scrypt_add_nonce(struct work *work, uint32_t *hash, uint32_t nonce)
+{
+	work_set_target_ratio(work, hash);
+	work->nonces[work->valid_nonces] = nonce;
+	work->sharediffs[work->valid_nonces++] = work->sharediff;
+}
+
+#ifdef HAVE_SCRYPT_PIPE
+/* PBKDF2 of a batch of consecutive nonces into X slot "slot" */
+static void scrypt_pipe_start(struct scrypt_pipe_state *st, int slot,
+	const uint32_t *pdata, uint32_t nonce, const uint32_t *midstate)
+{
+	uint32_t data[20];
+	int i, k;
+
+	memcpy(data, pdata, 80);
+	for (i = 0; i < SCRYPT_PIPE_LANES; i++) {
+		k = slot * SCRYPT_PIPE_LANES + i;
+		data[19] = nonce + i;
+		memcpy(st->tstate + k * 8, midstate, 32);
+		HMAC_SHA256_80_init(data, st->tstate + k * 8, st->ostate + k * 8);
+		PBKDF2_SHA256_80_128(st->tstate + k * 8, st->ostate + k * 8, data, st->X + k * 32);
+	}
+}
+
+/*
+ * One kernel call finishes the batch in slot "which" and runs the first
+ * loop of the next one, which stays in the scratchpad state until the
+ * following round, or the following call for the same header. After the
+ * batch that reaches max_nonce, the next one is work->next_nonce's.
+ */
+static int scanhash_scrypt_pipe(int thr_id, struct work *work, uint32_t max_nonce,
+	uint64_t *hashes_done, unsigned char *scratchbuf, uint32_t N)
+{
+	struct scrypt_pipe_state *st = (struct scrypt_pipe_state *) scratchbuf;
+	uint32_t *V = (uint32_t *)(((uintptr_t)(st + 1) + 63) & ~ (uintptr_t)(63));
+	uint32_t *pdata = work->data;
+	uint32_t *ptarget = work->target;
+	uint32_t hash[SCRYPT_PIPE_LANES * 8];
+	uint32_t midstate[8];
+	uint32_t n = pdata[19] - 1, next;
+	const uint32_t Htarg = ptarget[7];
+	const volatile uint8_t *stop = &work_restart[thr_id].restart;
+	int i, k, w, lanes;
+
+	sha256_init(midstate);
+	sha256_transform(midstate, pdata, 0);
+
+	if (!st->valid || st->N != N || memcmp(st->data, pdata, 76) || st->data[19] != pdata[19]) {
+		/* the same header from elsewhere: the batch in flight is lost */
+		if (st->valid && st->N == N && !memcmp(st->data, pdata, 76))
+			st->dropped += SCRYPT_PIPE_LANES;
+		/* prime: the second loop on slot 0 runs on stale data */
+		st->valid = 0;
+		scrypt_pipe_start(st, 1, pdata, pdata[19], midstate);
+		if (!scrypt_romix_pipe(scrypt_kernel, scrypt_prefetch, st->X, V, N, 0, stop)) {
+			*hashes_done = 0;
+			pdata[19] = n;
+			return 0;
+		}
+		memcpy(st->data, pdata, 80);
+		st->N = N;
+		st->which = 1;
+		st->valid = 1;
+	}
+
+	do {
+		w = st->which;
+		next = n + 1 + SCRYPT_PIPE_LANES;
+		if (next - 1 - pdata[19] >= max_nonce - pdata[19])
+			next = work->next_nonce;
+		scrypt_pipe_start(st, w ^ 1, pdata, next, midstate);
+		if (!scrypt_romix_pipe(scrypt_kernel, scrypt_prefetch, st->X, V, N, w, stop)) {
+			/* restart, before or during the batch: both slots are stale */
+			st->valid = 0;
+			break;
+		}
+		for (i = 0; i < SCRYPT_PIPE_LANES; i++) {
+			k = w * SCRYPT_PIPE_LANES + i;
+			PBKDF2_SHA256_128_32(st->tstate + k * 8, st->ostate + k * 8, st->X + k * 32, hash + i * 8);
+		}
+
+		lanes = scrypt_batch_lanes(pdata[19], n + SCRYPT_PIPE_LANES, max_nonce, SCRYPT_PIPE_LANES);
+		for (i = 0; i < lanes; i++)
+			if (unlikely(hash[i * 8 + 7] <= Htarg && fulltest(hash + i * 8, ptarget)))
+				scrypt_add_nonce(work, hash + i * 8, n + 1 + i);
+		n += SCRYPT_PIPE_LANES;
+		st->which = w ^ 1;
+		st->data[19] = next;
+		/* the lanes past max_nonce are another thread's */
+		if (lanes < SCRYPT_PIPE_LANES)
+			n = max_nonce;
+		/* the next batch stays in flight, it starts at st->data[19] */
+		if (work->valid_nonces) {
+			*hashes_done = n - pdata[19] + 1;
+			pdata[19] = n;
+			return work->valid_nonces;
+		}
+	} while (likely(n - pdata[19] < max_nonce - pdata[19] && !work_restart[thr_id].restart));
+
+	*hashes_done = n - pdata[19] + 1;
+	pdata[19] = n;
+	return 0;
+}
+#endif /* HAVE_SCRYPT_PIPE */
+
+/*
+ * Lanes whose first loop a pipelined thread ran and then threw away,
+ * because its next scan of the header did not start where the batch in
+ * flight did, since the last call. 0 for the other kernels.
+ */
+uint32_t scrypt_pipe_dropped(unsigned char *scratchbuf)
+{
+	uint32_t dropped = 0;
+
+#ifdef HAVE_SCRYPT_PIPE
+	if (scratchbuf && scrypt_pipelined(-1)) {
+		struct scrypt_pipe_state *st = (struct scrypt_pipe_state *) scratchbuf;
+		dropped = st->dropped;
+		st->dropped = 0;
+	}
+#endif
+	return dropped;
+}
+
+/*
+ * Scans from pdata[19] to max_nonce, batch by batch. Returns the number
+ * of nonces of the batch that met the target, all of them in
+ * work->nonces, with pdata[19] on the batch's last nonce: scanning goes
+ * on after it, no lane gets hashed twice. *hashes_done counts the nonces
+ * from pdata[19] on that were scanned, never past max_nonce: the nonce
+ * dispenser moves on by it. A batch over max_nonce still hashes all its
+ * lanes but only reports and counts those up to it, so a caller timing
+ * the kernel passes a max_nonce that spans whole batches of
+ * scrypt_get_lanes() (1 for a oneway thread). work->next_nonce is where
+ * the caller's next scan of the header starts, usually max_nonce + 1: a
+ * pipelined kernel runs the first loop of that batch during this scan.
+ */
 extern int scanhash_scrypt(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *hashes_done,
 	unsigned char *scratchbuf, uint32_t N, int forceThroughput)
 {
@@ -2102,18 +3929,19 @@ extern int scanhash_scrypt(int thr_id, struct work *work, uint32_t max_nonce, ui
 	uint32_t midstate[8];
 	uint32_t n = pdata[19] - 1;
 	const uint32_t Htarg = ptarget[7];
-	int throughput = scrypt_best_throughput();
-	if (opt_ryzen_1x) {
-		// force throughput to be 3 (aka AVX) instead of AVX2.
-		throughput = 3;
-	}
-
-	int i;
-	
-#ifdef HAVE_SHA256_4WAY
-	if (sha256_use_4way())
-		throughput *= 4;
-#endif	
+	int throughput = scrypt_lanes;
+#if defined(HAVE_SHA256_4WAY)
+	int ways = forceThroughput == -1 ? scrypt_kernel->ways : 1;
+#endif
+	const volatile uint8_t *stop = &work_restart[thr_id].restart;
+	bool hashed;
+	int i, lanes;
+
+	work->valid_nonces = 0;
+#ifdef HAVE_SCRYPT_PIPE
+	if (forceThroughput == -1 && scrypt_kernel->pipe[0])
+		return scanhash_scrypt_pipe(thr_id, work, max_nonce, hashes_done, scratchbuf, N);
+#endif
 
 	if (forceThroughput != -1)
 	{
@@ -2131,36 +3959,52 @@ extern int scanhash_scrypt(int thr_id, struct work *work, uint32_t max_nonce, ui
 			data[i * 20 + 19] = ++n;
 		
 #if defined(HAVE_SHA256_4WAY)
-		if (throughput == 4)
-			scrypt_1024_1_1_256_4way(data, hash, midstate, scratchbuf, N);
+		if (throughput == 4 && ways == 1)
+			hashed = scrypt_1024_1_1_256_4way(data, hash, midstate, scratchbuf, N, stop);
 		else
 #endif
 #if defined(HAVE_SCRYPT_3WAY) && defined(HAVE_SHA256_4WAY)
 		if (throughput == 12)
-			scrypt_1024_1_1_256_12way(data, hash, midstate, scratchbuf, N);
+			hashed = scrypt_1024_1_1_256_12way(data, hash, midstate, scratchbuf, N, stop);
 		else
 #endif
 #if defined(HAVE_SCRYPT_6WAY)
 		if (throughput == 24)
-			scrypt_1024_1_1_256_24way(data, hash, midstate, scratchbuf, N);
+			hashed = scrypt_1024_1_1_256_24way(data, hash, midstate, scratchbuf, N, stop);
+		else
+#endif
+#if defined(HAVE_SCRYPT_16WAY)
+		if (throughput == 16)
+			hashed = scrypt_1024_1_1_256_16way(data, hash, midstate, scratchbuf, N, stop);
 		else
 #endif
 #if defined(HAVE_SCRYPT_3WAY)
 		if (throughput == 3)
-			scrypt_1024_1_1_256_3way(data, hash, midstate, scratchbuf, N);
+			hashed = scrypt_1024_1_1_256_3way(data, hash, midstate, scratchbuf, N, stop);
 		else
 #endif
-			scrypt_1024_1_1_256(data, hash, midstate, scratchbuf, N);
+		if (throughput > 1)
+			hashed = scrypt_1024_1_1_256_nway(data, hash, midstate, scratchbuf, N, throughput, stop);
+		else
+			hashed = scrypt_1024_1_1_256(data, hash, midstate, scratchbuf, N, stop);
+		if (!hashed) {
+			/* restart, before or during the batch: none of it got hashed */
+			n -= throughput;
+			break;
+		}
 		
-		for (i = 0; i < throughput; i++) {
-			if (unlikely(hash[i * 8 + 7] <= Htarg && fulltest(hash + i * 8, ptarget))) {
-				work_set_target_ratio(work, hash + i * 8);
-				*hashes_done = n - pdata[19] + 1;
-				pdata[19] = data[i * 20 + 19];
-				return 1;
-			}
+		lanes = scrypt_batch_lanes(pdata[19], n, max_nonce, throughput);
+		for (i = 0; i < lanes; i++)
+			if (unlikely(hash[i * 8 + 7] <= Htarg && fulltest(hash + i * 8, ptarget)))
+				scrypt_add_nonce(work, hash + i * 8, data[i * 20 + 19]);
+		if (lanes < throughput)
+			n = max_nonce;
+		if (work->valid_nonces) {
+			*hashes_done = n - pdata[19] + 1;
+			pdata[19] = n;
+			return work->valid_nonces;
 		}
-	} while (likely(n < max_nonce && !work_restart[thr_id].restart));
+	} while (likely(n - pdata[19] < max_nonce - pdata[19] && !work_restart[thr_id].restart));
 	
 	*hashes_done = n - pdata[19] + 1;
 	pdata[19] = n;
@@ -2180,7 +4024,7 @@ void scrypthash(void *output, const void *input, uint32_t N)
 	sha256_init(midstate);
 	sha256_transform(midstate, input, 0);
 
-	scrypt_1024_1_1_256((uint32_t*)input, (uint32_t*)output, midstate, scratchbuf, N);
+	scrypt_1024_1_1_256((uint32_t*)input, (uint32_t*)output, midstate, scratchbuf, N, NULL);
 
-	free(scratchbuf);
+	scrypt_buffer_free(scratchbuf);
 }
@@ -8,7 +8,7 @@
  * Software Foundation; either version 2 of the License, or (at your option)
  * any later version.  See COPYING for more details.
  */
-#define APIVERSION "1.1"
+#define APIVERSION "1.2"
 
 #ifdef WIN32
 # define  _WINSOCK_DEPRECATED_NO_WARNINGS
@@ -96,6 +96,12 @@ extern char *opt_api_allow;
 extern int opt_api_listen; /* port */
 extern int opt_api_remote;
 extern double global_hashrate;
+extern double time_to_first_hash;
+extern double job_switch_ms;
+extern uint64_t pipe_dropped;
+extern struct rpc_stats getwork_stats;
+extern struct rpc_stats submit_stats;
+extern pthread_mutex_t stats_lock;
 extern uint32_t solved_count;
 extern uint32_t accepted_count;
 extern uint32_t rejected_count;
@@ -118,7 +124,8 @@ static void cpustatus(int thr_id)
 		cpu->thr_id = thr_id;
 		cpu->khashes = thr_hashrates[thr_id] / 1000.0; //todo: stats_get_speed(thr_id, 0.0) / 1000.0;
 
-		snprintf(buf, sizeof(buf), "CPU=%d;KHS=%.2f|", thr_id, cpu->khashes);
+		snprintf(buf, sizeof(buf), "CPU=%d;KHS=%.2f;PAGES=%s;NODE=%d;LOCAL=%d|", thr_id,
+			cpu->khashes, cpu->pages ? cpu->pages : "none", cpu->numa_node, cpu->numa_local);
 
 		// append to buffer
 		strcat(buffer, buf);
@@ -133,6 +140,7 @@ static void cpustatus(int thr_id)
 static char *getsummary(char *params)
 {
 	char algo[64]; *algo = '\0';
+	char pages[64], arena[64];
 	time_t ts = time(NULL);
 	double uptime = difftime(ts, startup);
 	double accps = (60.0 * accepted_count) / (uptime ? uptime : 1.0);
@@ -145,18 +153,31 @@ static char *getsummary(char *params)
 	cpu.cpu_clock = cpu_clock(0);
 #endif
 
+	/* the workio thread updates them as its transfers end */
+	pthread_mutex_lock(&stats_lock);
+	struct rpc_stats gw = getwork_stats, sub = submit_stats;
+	double switch_ms = job_switch_ms;
+	uint64_t dropped = pipe_dropped;
+	pthread_mutex_unlock(&stats_lock);
+	double gw_ms = gw.count ? gw.total_ms / gw.count : 0.;
+	double sub_ms = sub.count ? sub.total_ms / sub.count : 0.;
+
 	get_currentalgo(algo, sizeof(algo));
+	scrypt_pages_report(pages, sizeof(pages));
+	scrypt_arena_report(arena, sizeof(arena));
 
 	*buffer = '\0';
 	sprintf(buffer, "NAME=%s;VER=%s;API=%s;"
-		"ALGO=%s;CPUS=%d;KHS=%.5f;SOLV=%d;ACC=%d;REJ=%d;"
+		"ALGO=%s;KERNEL=%s;CPUS=%d;KHS=%.5f;SOLV=%d;ACC=%d;REJ=%d;"
 		"ACCMN=%.3f;DIFF=%.6f;TEMP=%.1f;FAN=%d;FREQ=%d;"
+		"PAGES=%s;ARENA=%s;TTFH=%.2f;SWITCH=%.1f;DROPPED=%llu;GETWORK=%.1f/%.1f;SUBMIT=%.1f/%.1f;"
 		"UPTIME=%.0f;TS=%u|",
 		PACKAGE_NAME, PACKAGE_VERSION, APIVERSION,
-		algo, opt_n_total_threads, global_hashrate / 1000.0,
+		algo, scrypt_kernel_name(-1), opt_n_total_threads, global_hashrate / 1000.0,
 		solved_count, accepted_count, rejected_count, accps, net_diff > 0. ? net_diff : stratum_diff,
 		cpu.cpu_temp, cpu.cpu_fan, cpu.cpu_clock,
-		uptime, (uint32_t) ts);
+		pages, arena, time_to_first_hash, switch_ms, (unsigned long long) dropped,
+		gw_ms, gw.max_ms, sub_ms, sub.max_ms, uptime, (uint32_t) ts);
 	return buffer;
 }
 
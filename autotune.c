@@ -0,0 +1,576 @@
+/*
+ * Scrypt kernel/thread autotuner
+ *
+ * Benchmarks every kernel this CPU supports with each lane count it can
+ * run (and the TMTO kernel with a few ratios), then the best one with a
+ * few default/oneway thread splits, prefetch hints and V layouts, and keeps the
+ * winner in a small JSON profile so that later starts on the same
+ * machine reuse it without tuning again.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include <cpuminer-config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <jansson.h>
+
+#include "miner.h"
+
+/* timed part of one trial, after a warm-up round */
+#define AUTOTUNE_TRIAL_SECS 5
+/* blocks of the cache-resident scratchpad in scrypt_prefetch_report() */
+#define PREFETCH_REPORT_SMALL_N 128
+/* in the profile key, older profiles are tuned again; 2: rates counted per lane */
+#define AUTOTUNE_PROFILE_VERSION 2
+
+struct autotune_config {
+	const char *kernel;
+	int lanes;
+	const char *prefetch;
+	const char *layout; /* NULL: the current one */
+	int tmto; /* ratio, tmto kernel only */
+	int n_default;
+	int n_oneway;
+	double hashrate; /* H/m */
+};
+
+struct autotune_trial {
+	const struct autotune_config *cfg;
+	int N;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int waiting;
+	int generation;
+	double hashrate; /* H/s */
+	bool failed;
+};
+
+struct autotune_thread {
+	struct autotune_trial *trial;
+	pthread_t pth;
+	int thr_id;
+};
+
+static void autotune_barrier(struct autotune_trial *trial)
+{
+	int n = trial->cfg->n_default + trial->cfg->n_oneway;
+	int gen;
+
+	pthread_mutex_lock(&trial->lock);
+	gen = trial->generation;
+	if (++trial->waiting == n) {
+		trial->waiting = 0;
+		trial->generation++;
+		pthread_cond_broadcast(&trial->cond);
+	} else {
+		while (gen == trial->generation)
+			pthread_cond_wait(&trial->cond, &trial->lock);
+	}
+	pthread_mutex_unlock(&trial->lock);
+}
+
+static void *autotune_thread(void *userdata)
+{
+	struct autotune_thread *mythr = (struct autotune_thread *) userdata;
+	struct autotune_trial *trial = mythr->trial;
+	int thr_id = mythr->thr_id;
+	int forceThroughput = thr_id < trial->cfg->n_default ? -1 : 1;
+	uint32_t lanes = forceThroughput == -1 ? (uint32_t) scrypt_get_lanes() : 1;
+	struct timeval tv_start, tv_end, diff;
+	unsigned char *scratchbuf;
+	struct work work;
+	uint64_t hashes_done, total = 0;
+	double elapsed;
+
+	memset(&work, 0, sizeof(work));
+	work.data[19] = 0x10000000U * thr_id + 1;
+	/* a zero target never yields a share, every round hashes all lanes */
+
+	scratchbuf = scrypt_buffer_alloc(trial->N, forceThroughput);
+	autotune_barrier(trial);
+	if (!scratchbuf) {
+		autotune_barrier(trial);
+		pthread_mutex_lock(&trial->lock);
+		trial->failed = true;
+		pthread_mutex_unlock(&trial->lock);
+		return NULL;
+	}
+
+	/*
+	 * max_nonce on the batch's last lane: exactly one round per call, all
+	 * of it counted; the next call goes on after it, as the miner does,
+	 * so the pipe kernel keeps its next batch in flight
+	 */
+	work.next_nonce = work.data[19] + lanes;
+	scanhash_scrypt(thr_id, &work, work.data[19] + lanes - 1, &hashes_done,
+		scratchbuf, trial->N, forceThroughput);
+	work.data[19]++;
+	autotune_barrier(trial);
+
+	gettimeofday(&tv_start, NULL);
+	do {
+		work.next_nonce = work.data[19] + lanes;
+		scanhash_scrypt(thr_id, &work, work.data[19] + lanes - 1, &hashes_done,
+			scratchbuf, trial->N, forceThroughput);
+		work.data[19]++;
+		total += hashes_done;
+		gettimeofday(&tv_end, NULL);
+		timeval_subtract(&diff, &tv_end, &tv_start);
+	} while (diff.tv_sec < AUTOTUNE_TRIAL_SECS);
+	elapsed = diff.tv_sec + 1e-6 * diff.tv_usec;
+
+	scrypt_buffer_free(scratchbuf);
+
+	pthread_mutex_lock(&trial->lock);
+	trial->hashrate += total / elapsed;
+	pthread_mutex_unlock(&trial->lock);
+	return NULL;
+}
+
+/* kernel name for the log, with the ratio of the tmto kernel */
+static const char *autotune_kernel(const struct autotune_config *cfg, char *buf, size_t sz)
+{
+	if (cfg->layout)
+		snprintf(buf, sz, "%s %s", cfg->kernel, cfg->layout);
+	else if (cfg->tmto)
+		snprintf(buf, sz, "%s/%d", cfg->kernel, cfg->tmto);
+	else
+		return cfg->kernel;
+	return buf;
+}
+
+static bool autotune_apply(const struct autotune_config *cfg)
+{
+	if (!scrypt_set_kernel(cfg->kernel))
+		return false;
+	if (cfg->tmto && !scrypt_set_tmto(cfg->tmto))
+		return false;
+	if (cfg->prefetch && !scrypt_set_prefetch(cfg->prefetch))
+		return false;
+	if (cfg->layout && !scrypt_set_layout(cfg->layout))
+		return false;
+	return scrypt_set_lanes(cfg->lanes);
+}
+
+static bool autotune_run(struct autotune_config *cfg, int N)
+{
+	struct autotune_trial trial;
+	struct autotune_thread *thr;
+	int n = cfg->n_default + cfg->n_oneway;
+	uint64_t mem = sys_memory_size();
+	uint64_t need;
+	char label[64];
+	int i, ways = 1;
+
+	cfg->hashrate = 0.;
+	if (!autotune_apply(cfg))
+		return false;
+	for (i = 0; i < scrypt_kernel_count(); i++) {
+		const char *name = scrypt_kernel_info(i, &ways);
+		if (name && !strcmp(name, cfg->kernel))
+			break;
+	}
+
+	need = ((uint64_t) cfg->n_default * ways + cfg->n_oneway) * 128 *
+		(N / (cfg->tmto ? cfg->tmto : 1) + 1);
+	if (mem && need > mem / 10 * 9) {
+		applog(LOG_INFO, "Autotune: %s x%d %s, %d+%d threads: skipped, needs %" PRIu64 " MiB",
+			autotune_kernel(cfg, label, sizeof(label)), cfg->lanes, scrypt_prefetch_name(-1), cfg->n_default,
+			cfg->n_oneway, need >> 20);
+		return false;
+	}
+
+	memset(&trial, 0, sizeof(trial));
+	trial.cfg = cfg;
+	trial.N = N;
+	pthread_mutex_init(&trial.lock, NULL);
+	pthread_cond_init(&trial.cond, NULL);
+
+	thr = (struct autotune_thread *) calloc(n, sizeof(*thr));
+	if (!thr)
+		return false;
+	for (i = 0; i < n; i++) {
+		thr[i].trial = &trial;
+		thr[i].thr_id = i;
+		if (pthread_create(&thr[i].pth, NULL, autotune_thread, &thr[i])) {
+			applog(LOG_ERR, "Autotune: thread %d create failed", i);
+			exit(1);
+		}
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(thr[i].pth, NULL);
+	free(thr);
+
+	pthread_cond_destroy(&trial.cond);
+	pthread_mutex_destroy(&trial.lock);
+
+	if (trial.failed) {
+		applog(LOG_INFO, "Autotune: %s x%d %s, %d+%d threads: allocation failed",
+			autotune_kernel(cfg, label, sizeof(label)), cfg->lanes, scrypt_prefetch_name(-1), cfg->n_default,
+			cfg->n_oneway);
+		return false;
+	}
+	cfg->hashrate = trial.hashrate * 60.;
+	applog(LOG_INFO, "Autotune: %s x%d %s, %d+%d threads: %.2f H/m",
+		autotune_kernel(cfg, label, sizeof(label)), cfg->lanes, scrypt_prefetch_name(-1), cfg->n_default,
+		cfg->n_oneway, cfg->hashrate);
+	return true;
+}
+
+/* run one stage 1 configuration, keep it in best if it is faster */
+static void autotune_try(struct autotune_config *best, const char *kernel, int lanes,
+	int tmto, int N)
+{
+	struct autotune_config cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.kernel = kernel;
+	cfg.lanes = lanes;
+	cfg.prefetch = scrypt_prefetch_name(-1);
+	cfg.tmto = tmto;
+	cfg.n_default = opt_n_default_threads;
+	cfg.n_oneway = opt_n_oneway_threads;
+	if (!scrypt_set_kernel(kernel) || !scrypt_set_lanes(lanes))
+		return;
+	if (autotune_run(&cfg, N) && cfg.hashrate > best->hashrate)
+		*best = cfg;
+}
+
+static void autotune_key(char *key, size_t sz, int N, const char *kernel,
+	const char *prefetch, const char *layout, int tmto, bool tune_threads, int n_default,
+	int n_oneway)
+{
+	char name[128] = { 0 }, model[64] = { 0 };
+	char threads[32], ratio[16] = "", lay[32] = "";
+
+	cpu_getname(name, sizeof(name));
+	cpu_getmodelid(model, sizeof(model));
+	if (tune_threads)
+		sprintf(threads, "%d", n_default + n_oneway);
+	else
+		sprintf(threads, "%d/%d", n_default, n_oneway);
+	if (tmto)
+		sprintf(ratio, " tmto:%d", tmto);
+	if (layout)
+		snprintf(lay, sizeof(lay), " layout:%s", layout);
+	snprintf(key, sz, "v%d %s [%s] mem:%" PRIu64 "G N:%d kernel:%s threads:%s%s%s%s%s%s%s",
+		AUTOTUNE_PROFILE_VERSION, name, model, (sys_memory_size() + (1 << 29)) >> 30, N,
+		kernel ? kernel : "auto", threads,
+		opt_ryzen_1x ? " ryzen" : "", opt_no_avx512 ? " no-avx512" : "",
+		prefetch ? " prefetch:" : "", prefetch ? prefetch : "", ratio, lay);
+}
+
+static bool autotune_load(const char *file, const char *key, struct autotune_config *cfg)
+{
+	json_t *root, *val;
+	json_error_t err;
+	bool ok = false;
+
+	root = json_load_file(file, 0, &err);
+	if (!root)
+		return false;
+	val = json_object_get(root, key);
+	if (json_is_object(val)) {
+		const char *kernel = json_string_value(json_object_get(val, "kernel"));
+		if (kernel) {
+			cfg->kernel = strdup(kernel);
+			const char *prefetch = json_string_value(json_object_get(val, "prefetch"));
+			cfg->lanes = (int) json_integer_value(json_object_get(val, "lanes"));
+			cfg->prefetch = prefetch ? strdup(prefetch) : NULL;
+			const char *layout = json_string_value(json_object_get(val, "layout"));
+			cfg->layout = layout ? strdup(layout) : NULL;
+			cfg->tmto = (int) json_integer_value(json_object_get(val, "tmto"));
+			cfg->n_default = (int) json_integer_value(json_object_get(val, "threads"));
+			cfg->n_oneway = (int) json_integer_value(json_object_get(val, "oneways"));
+			cfg->hashrate = json_real_value(json_object_get(val, "hashrate"));
+			ok = true;
+		}
+	}
+	json_decref(root);
+	return ok;
+}
+
+static void autotune_save(const char *file, const char *key, const struct autotune_config *cfg)
+{
+	json_t *root, *val;
+	json_error_t err;
+
+	root = json_load_file(file, 0, &err);
+	if (!json_is_object(root)) {
+		json_decref(root);
+		root = json_object();
+	}
+	val = json_object();
+	json_object_set_new(val, "kernel", json_string(cfg->kernel));
+	json_object_set_new(val, "lanes", json_integer(cfg->lanes));
+	json_object_set_new(val, "prefetch", json_string(cfg->prefetch));
+	if (cfg->layout)
+		json_object_set_new(val, "layout", json_string(cfg->layout));
+	if (cfg->tmto)
+		json_object_set_new(val, "tmto", json_integer(cfg->tmto));
+	json_object_set_new(val, "threads", json_integer(cfg->n_default));
+	json_object_set_new(val, "oneways", json_integer(cfg->n_oneway));
+	json_object_set_new(val, "hashrate", json_real(cfg->hashrate));
+	json_object_set_new(root, key, val);
+
+	if (json_dump_file(root, file, JSON_INDENT(2)))
+		applog(LOG_WARNING, "Autotune: unable to write profile %s", file);
+	else
+		applog(LOG_INFO, "Autotune: profile saved to %s", file);
+	json_decref(root);
+}
+
+static void autotune_default_file(char *out, size_t sz)
+{
+#ifdef WIN32
+	snprintf(out, sz, "%s\\cpuminer-tune.json", getenv("APPDATA"));
+#else
+	const char *home = getenv("HOME");
+	snprintf(out, sz, "%s/.cpuminer-tune.json", home ? home : ".");
+#endif
+}
+
+/*
+ * Pick the kernel, lane count, prefetch hint, V layout and TMTO ratio (unless they
+ * were given) and (if tune_threads) the default/oneway split of
+ * opt_n_total_threads. A NULL or "auto" kernel tries every supported
+ * kernel, anything else only tunes the lanes of that one.
+ */
+bool scrypt_autotune(int N, const char *kernel, const char *prefetch, const char *layout,
+	int tmto, const char *profile_file, bool tune_threads)
+{
+	struct autotune_config best = { 0 }, cfg;
+	struct work_restart *own_restart = NULL;
+	bool automatic = !kernel || !strcasecmp(kernel, "auto");
+	char file[1024], key[512], label[64];
+	int n_threads = opt_n_total_threads;
+	int i, j, ways;
+
+	if (profile_file)
+		snprintf(file, sizeof(file), "%s", profile_file);
+	else
+		autotune_default_file(file, sizeof(file));
+	autotune_key(key, sizeof(key), N, kernel, prefetch, layout, tmto, tune_threads,
+		opt_n_default_threads, opt_n_oneway_threads);
+
+	if (autotune_load(file, key, &best)) {
+		if (best.n_default + best.n_oneway == n_threads && autotune_apply(&best)) {
+			opt_n_default_threads = best.n_default;
+			opt_n_oneway_threads = best.n_oneway;
+			applog(LOG_INFO, "Autotune: using cached profile %s x%d %s, %d+%d threads (%.2f H/m)",
+				autotune_kernel(&best, label, sizeof(label)), best.lanes, scrypt_prefetch_name(-1), best.n_default,
+				best.n_oneway, best.hashrate);
+			return true;
+		}
+		applog(LOG_WARNING, "Autotune: cached profile for this CPU is invalid, tuning again");
+		free((void *) best.kernel);
+		free((void *) best.prefetch);
+		free((void *) best.layout);
+		memset(&best, 0, sizeof(best));
+		if (prefetch)
+			scrypt_set_prefetch(prefetch);
+		scrypt_set_layout(layout ? layout : "interleave");
+		if (tmto)
+			scrypt_set_tmto(tmto);
+	}
+
+	applog(LOG_INFO, "Autotune: benchmarking scrypt kernels, this takes a few minutes...");
+
+	/* scanhash_scrypt polls work_restart, which main() allocates later */
+	if (!work_restart) {
+		own_restart = (struct work_restart *) calloc(n_threads, sizeof(*work_restart));
+		if (!own_restart)
+			return false;
+		work_restart = own_restart;
+	}
+
+	/* stage 1: kernels and lane counts */
+	for (i = 0; i < scrypt_kernel_count(); i++) {
+		const char *name = scrypt_kernel_info(i, &ways);
+		if (!name)
+			continue;
+		if (!automatic && strcasecmp(name, kernel))
+			continue;
+		if (automatic && opt_ryzen_1x && ways > 3)
+			continue;
+		if (automatic && opt_no_avx512 && ways == 16)
+			continue;
+		if (!strcmp(name, "tmto")) {
+			/* one lane, with each ratio unless --tmto gave one */
+			int ratios[3] = { 2, 4, 8 };
+			for (j = 0; j < (tmto ? 1 : 3); j++)
+				autotune_try(&best, name, ways, tmto ? tmto : ratios[j], N);
+			continue;
+		}
+		/* pipelined kernels run ways / 2, the others ways or 4 * ways */
+		int lanes[3] = { ways / 2, ways, 4 * ways };
+		for (j = 0; j < 3; j++)
+			autotune_try(&best, name, lanes[j], 0, N);
+	}
+
+	/* stage 2: move some threads to the oneway kernel */
+	if (tune_threads && best.kernel) {
+		int oneways[3] = { 1, n_threads / 2, n_threads };
+		for (i = 0; i < 3; i++) {
+			for (j = 0; j < i && oneways[j] != oneways[i]; j++);
+			if (!oneways[i] || j < i)
+				continue;
+			cfg = best;
+			cfg.n_default = n_threads - oneways[i];
+			cfg.n_oneway = oneways[i];
+			if (autotune_run(&cfg, N) && cfg.hashrate > best.hashrate)
+				best = cfg;
+		}
+	}
+
+	/* stage 3: the other prefetch hints */
+	if (!prefetch && best.kernel && autotune_apply(&best) && scrypt_prefetch_tunable()) {
+		const char *hint;
+		struct autotune_config first = best;
+		for (i = 0; (hint = scrypt_prefetch_name(i)); i++) {
+			if (!strcmp(hint, first.prefetch))
+				continue;
+			cfg = first;
+			cfg.prefetch = hint;
+			if (autotune_run(&cfg, N) && cfg.hashrate > best.hashrate)
+				best = cfg;
+		}
+	}
+
+	/* stage 4: the other V layouts, for the kernels that have them */
+	if (!layout && best.kernel && autotune_apply(&best) && scrypt_layout_tunable()) {
+		const char *name;
+		struct autotune_config first = best;
+		/* so that the winner sets its layout back even if it is this one */
+		first.layout = best.layout = scrypt_layout_name(-1);
+		for (i = 0; (name = scrypt_layout_name(i)); i++) {
+			if (!strcmp(name, first.layout))
+				continue;
+			cfg = first;
+			cfg.layout = name;
+			if (autotune_run(&cfg, N) && cfg.hashrate > best.hashrate)
+				best = cfg;
+		}
+	}
+
+	if (own_restart) {
+		work_restart = NULL;
+		free(own_restart);
+	}
+
+	if (!best.kernel || !autotune_apply(&best)) {
+		applog(LOG_ERR, "Autotune: no usable configuration found, keeping defaults");
+		scrypt_set_kernel(kernel);
+		return false;
+	}
+	opt_n_default_threads = best.n_default;
+	opt_n_oneway_threads = best.n_oneway;
+	applog(LOG_NOTICE, "Autotune: best is %s x%d %s, %d+%d threads (%.2f H/m)",
+		autotune_kernel(&best, label, sizeof(label)), best.lanes, best.prefetch, best.n_default, best.n_oneway,
+		best.hashrate);
+	autotune_save(file, key, &best);
+	return true;
+}
+
+/*
+ * For --benchmark: how much of the DRAM latency each prefetch hint hides
+ * for the selected kernel. One thread times a full-N round per hint, and
+ * the same number of block operations on a scratchpad small enough to
+ * stay in cache, which stands for a round that never stalls.
+ */
+void scrypt_prefetch_report(int N)
+{
+	unsigned char *scratchbuf;
+	double t[4], t_off = 0., t_ideal, stall;
+	const char *hint;
+	int i, off = -1;
+
+	if (!scrypt_prefetch_tunable()) {
+		applog(LOG_INFO, "Prefetch report: the %s kernel does not prefetch",
+			scrypt_kernel_name(-1));
+		return;
+	}
+	scratchbuf = scrypt_buffer_alloc(N, -1);
+	if (!scratchbuf) {
+		applog(LOG_WARNING, "Prefetch report: scratchpad allocation failed");
+		return;
+	}
+	applog(LOG_INFO, "Measuring how well the %s kernel hides memory latency...",
+		scrypt_kernel_name(-1));
+
+	/* the first round also faults the scratchpad in */
+	scrypt_core_time(scratchbuf, N, 0, 1);
+	for (i = 0; (hint = scrypt_prefetch_name(i)); i++) {
+		t[i] = scrypt_core_time(scratchbuf, N, i, 1);
+		if (!strcmp(hint, "off")) {
+			off = i;
+			t_off = t[i];
+		}
+	}
+	t_ideal = scrypt_core_time(scratchbuf, PREFETCH_REPORT_SMALL_N, off,
+		N / PREFETCH_REPORT_SMALL_N);
+	scrypt_buffer_free(scratchbuf);
+
+	applog(LOG_INFO, "Prefetch report: %.3fs per round without prefetch, %.3fs from cache",
+		t_off, t_ideal);
+	stall = t_off - t_ideal;
+	if (stall < t_off * 0.02) {
+		applog(LOG_INFO, "Prefetch report: scratchpad reads hardly stall, nothing to hide");
+		return;
+	}
+	for (i = 0; (hint = scrypt_prefetch_name(i)); i++) {
+		if (i == off)
+			continue;
+		applog(LOG_INFO, "Prefetch report: %s %.3fs per round, hides %.0f%% of the memory stall time%s",
+			hint, t[i], 100. * (t_off - t[i]) / stall,
+			strcmp(hint, scrypt_prefetch_name(-1)) ? "" : " (in use)");
+	}
+}
+
+/*
+ * For --benchmark: full-N rounds of the selected kernel on one thread
+ * with each V layout, for the kernels that take one.
+ */
+void scrypt_layout_report(int N)
+{
+	unsigned char *scratchbuf;
+	char current[32];
+	const char *name;
+	int i, hint = 0;
+
+	if (!scrypt_layout_tunable())
+		return;
+	snprintf(current, sizeof(current), "%s", scrypt_layout_name(-1));
+	/* the staggered layout needs the most room */
+	scrypt_set_layout("stagger");
+	scratchbuf = scrypt_buffer_alloc(N, -1);
+	if (!scratchbuf) {
+		scrypt_set_layout(current);
+		applog(LOG_WARNING, "Layout report: scratchpad allocation failed");
+		return;
+	}
+	applog(LOG_INFO, "Timing the %s kernel with each scratchpad layout...",
+		scrypt_kernel_name(-1));
+
+	while (scrypt_prefetch_name(hint) != scrypt_prefetch_name(-1))
+		hint++;
+	/* the first round also faults the scratchpad in */
+	scrypt_core_time(scratchbuf, N, hint, 1);
+	for (i = 0; (name = scrypt_layout_name(i)); i++) {
+		scrypt_set_layout(name);
+		applog(LOG_INFO, "Layout report: %s %.3fs per round%s", name,
+			scrypt_core_time(scratchbuf, N, hint, 1),
+			strcmp(name, current) ? "" : " (in use)");
+	}
+	scrypt_buffer_free(scratchbuf);
+	scrypt_set_layout(current);
+}
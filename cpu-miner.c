@@ -106,9 +106,9 @@ static int opt_fail_pause = 10;
 static int opt_time_limit = 0;
 int opt_timeout = 300;
 static int opt_scantime = 5;
-static int opt_scrypt_n = 1048576;
+static int opt_scrypt_n = 1048576; /* N of the jobs at startup */
 static int opt_pluck_n = 128;
-static unsigned int opt_nfactor = 6;
+static int opt_nfactor = 19; /* N = 2^(nfactor + 1) */
 int opt_n_default_threads = 0;
 int opt_n_oneway_threads = 0;
 int opt_n_total_threads = 0;
@@ -121,6 +121,14 @@ int opt_affinity_default_index = 0;
 int opt_affinity_oneway_index = 0;
 int opt_oneway_priority = 0;
 bool opt_ryzen_1x = false;
+bool opt_no_avx512 = false;
+static char *opt_kernel = NULL;
+static bool opt_autotune = false;
+static char *opt_autotune_file = NULL;
+static char *opt_prefetch = NULL;
+static char *opt_layout = NULL;
+static int opt_tmto = 0;
+static bool opt_no_numa = false;
 int* thread_affinty_array = NULL;
 int num_cpus;
 char *rpc_url;
@@ -160,6 +168,14 @@ uint32_t accepted_count = 0L;
 uint32_t rejected_count = 0L;
 double *thr_hashrates;
 double global_hashrate = 0;
+double time_to_first_hash = 0.; /* seconds from startup, 0 until then */
+double job_switch_ms = 0.; /* slowest thread to drop its batch on the last restart */
+uint64_t pipe_dropped = 0; /* nonces pipelined threads hashed halfway, then threw away */
+struct rpc_stats getwork_stats = { 0 }; /* HTTP work fetches of the workio thread */
+struct rpc_stats submit_stats = { 0 }; /* and its HTTP share submits */
+static struct timeval restart_time;
+static double first_work_secs = 0.;
+static struct timeval miner_start;
 double stratum_diff = 0.;
 double net_diff = 0.;
 double net_hashrate = 0.;
@@ -210,7 +226,9 @@ Options:\n\
       --randomize       Randomize scan range start to reduce duplicates\n\
   -f, --diff-factor     Divide req. difficulty by this factor (std is 1.0)\n\
   -m, --diff-multiplier Multiply difficulty by this factor (std is 1.0)\n\
-  -n, --nfactor         neoscrypt N-Factor\n\
+  -n, --nfactor=F       scrypt N-factor, N = 2^(F + 1) (default: 19, N = 1048576)\n\
+      --nfactor-schedule=TIME:F[,TIME:F...]  N-factor F for the jobs with a\n\
+                          block time of TIME (unix seconds) or later\n\
       --coinbase-addr=ADDR  payout address for solo mining\n\
       --coinbase-sig=TEXT  data to insert in the coinbase when possible\n\
       --no-longpoll     disable long polling support\n\
@@ -251,6 +269,21 @@ Options:\n\
       --max-rate=N[KMG] Only mine if net hashrate is less than specified value\n\
       --max-diff=N      Only mine if net difficulty is less than specified value\n\
       --ryzen           Force AVX, and disable AVX2.  Ryzen 1*** is much faster.\n\
+      --no-avx512       Use the AVX2 6-way kernel even if AVX-512 is available.\n\
+      --kernel=NAME     scrypt kernel to use (default: auto, picked from the\n\
+                          cpu features). An unknown name lists the kernels.\n\
+      --autotune        benchmark the kernels and thread splits once and keep\n\
+                          the fastest in a per-cpu profile\n\
+      --autotune-file=FILE  profile to use (default: ~/.cpuminer-tune.json)\n\
+      --prefetch=HINT   how the scrypt kernels prefetch the scratchpad: t0,\n\
+                          nta or off (default: t0, or tuned by --autotune)\n\
+      --tmto=K          run the time-memory tradeoff kernel, which keeps one\n\
+                          scratchpad block in K (2 to 64) and recomputes the rest\n\
+      --layout=NAME     scratchpad layout of the -c and -neon kernels: interleave,\n\
+                          stagger or contig, each also with -nt for streaming\n\
+                          stores (default: interleave, or tuned by --autotune)\n\
+      --no-numa         do not spread the threads over the NUMA nodes when no\n\
+                          --cpu-affinity* option is given (linux)\n\
   -c, --config=FILE     load a JSON-format configuration file\n\
   -V, --version         display version information and exit\n\
   -h, --help            display this help text and exit\n\
@@ -283,6 +316,15 @@ static struct option const options[] = {
     { "cpu-affinity-default-index", 1, NULL, 1051 },
     { "cpu-affinity-oneway-index", 1, NULL, 1052 },
     { "ryzen", 0, NULL, 2000 },
+    { "no-avx512", 0, NULL, 2001 },
+    { "kernel", 1, NULL, 2002 },
+    { "autotune", 0, NULL, 2003 },
+    { "autotune-file", 1, NULL, 2004 },
+    { "prefetch", 1, NULL, 2005 },
+    { "tmto", 1, NULL, 2006 },
+    { "no-numa", 0, NULL, 2007 },
+    { "layout", 1, NULL, 2008 },
+    { "nfactor-schedule", 1, NULL, 2009 },
     { "no-color", 0, NULL, 1002 },
     { "debug", 0, NULL, 'D' },
     { "diff-factor", 1, NULL, 'f' },
@@ -380,6 +422,16 @@ static void affine_to_cpu(int id, int cpuid) {
     }
 }
 
+/* all the cpus of a NUMA node, so the scratchpad stays local */
+static void affine_to_node(int id, int node) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < num_cpus && i < CPU_SETSIZE; i++) {
+        if (numa_node_of_cpu(i) == node) { CPU_SET(i, &set); }
+    }
+    pthread_setaffinity_np(thr_info[id].pth, sizeof(set), &set);
+}
+
 #elif defined(WIN32) /* Windows */
 static inline void drop_policy(void) { }
 static void affine_to_cpu_mask(int id, unsigned long mask) {
@@ -393,6 +445,86 @@ static inline void drop_policy(void) { }
 static void affine_to_cpu_mask(int id, unsigned long mask) { }
 #endif
 
+/*
+ * NUMA node thread thr_id will run on, -1 if it is free to roam or the
+ * host has a single node. Mirrors the binding done in miner_thread().
+ */
+static int thread_numa_node(int thr_id)
+{
+    unsigned long mask;
+    int node = -1;
+
+    if (numa_node_count() < 2)
+        return -1;
+    if (use_affinity_mask == 0)
+        return opt_no_numa ? -1 : thr_id % numa_node_count();
+    if (use_affinity_mask != 1)
+        return numa_node_of_cpu(thread_affinty_array[thr_id] % num_cpus);
+    mask = (unsigned long) (thr_id >= opt_n_default_threads ? opt_affinity_mask_oneway : opt_affinity_mask_default);
+    if (mask == (unsigned long) -1L)
+        return opt_n_total_threads > 1 ? numa_node_of_cpu(thr_id % num_cpus) : -1;
+    for (int i = 0; i < num_cpus && i < (int) (8 * sizeof(mask)); i++) {
+        if (!(mask & (1UL << i)))
+            continue;
+        if (node >= 0 && numa_node_of_cpu(i) != node)
+            return -1;
+        node = numa_node_of_cpu(i);
+    }
+    return node;
+}
+
+/* N = 2^30 is as far as the kernels' int N goes */
+#define NFACTOR_MAX 29
+#define NFACTOR_STEPS 16
+
+/* --nfactor-schedule: N-factor of the jobs from a block time on */
+static struct {
+    uint32_t time;
+    int nfactor;
+} nfactor_schedule[NFACTOR_STEPS];
+static int nfactor_steps = 0;
+
+/* "TIME:F[,TIME:F...]" with times increasing */
+static bool parse_nfactor_schedule(const char *arg)
+{
+    char *p = (char *) arg;
+    int steps = 0;
+
+    while (*p) {
+        unsigned long t;
+        long f;
+
+        if (steps == NFACTOR_STEPS)
+            return false;
+        t = strtoul(p, &p, 10);
+        if (*p != ':')
+            return false;
+        f = strtol(p + 1, &p, 10);
+        if (f < 0 || f > NFACTOR_MAX || t > UINT32_MAX ||
+            (steps && t <= nfactor_schedule[steps - 1].time))
+            return false;
+        nfactor_schedule[steps].time = (uint32_t) t;
+        nfactor_schedule[steps].nfactor = (int) f;
+        steps++;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return false;
+    }
+    nfactor_steps = steps;
+    return steps > 0;
+}
+
+/* scrypt N of the jobs with block time ntime */
+static uint32_t scrypt_job_n(uint32_t ntime)
+{
+    int nfactor = opt_nfactor;
+
+    for (int i = 0; i < nfactor_steps && ntime >= nfactor_schedule[i].time; i++)
+        nfactor = nfactor_schedule[i].nfactor;
+    return 1U << (nfactor + 1);
+}
+
 void get_currentalgo(char* buf, int sz)
 {
     snprintf(buf, sz, "%s", "scrypt");
@@ -493,14 +625,15 @@ err_out:
 static const char *info_req =
 "{\"method\": \"getmininginfo\", \"params\": [], \"id\":8}\r\n";
 
-static bool get_mininginfo(CURL *curl, struct work *work)
+/* the wallet is asked for it alongside getwork and gbt */
+static bool mininginfo_wanted(void)
 {
-    if (have_stratum || have_longpoll || !allow_mininginfo)
-        return false;
-
-    int curl_err = 0;
-    json_t *val = json_rpc_call(curl, rpc_url, rpc_userpass, info_req, &curl_err, 0);
+    return !have_stratum && !have_longpoll && allow_mininginfo;
+}
 
+/* takes in a getmininginfo answer, and completes the height of work if given */
+static bool mininginfo_decode(const json_t *val, int curl_err, struct work *work)
+{
     if (!val && curl_err == -1) {
         allow_mininginfo = false;
         if (opt_debug) {
@@ -529,7 +662,7 @@ static bool get_mininginfo(CURL *curl, struct work *work)
             if (key && json_is_integer(key)) {
                 net_blocks = json_integer_value(key);
             }
-            if (!work->height) {
+            if (work && !work->height) {
                 // complete missing data from getwork
                 work->height = (uint32_t) net_blocks + 1;
                 if (work->height > g_work.height) {
@@ -550,10 +683,24 @@ static bool get_mininginfo(CURL *curl, struct work *work)
             }
         }
     }
-    json_decref(val);
     return true;
 }
 
+static bool get_mininginfo(CURL *curl, struct work *work)
+{
+    bool rc;
+
+    if (!mininginfo_wanted())
+        return false;
+
+    int curl_err = 0;
+    json_t *val = json_rpc_call(curl, rpc_url, rpc_userpass, info_req, &curl_err, 0);
+
+    rc = mininginfo_decode(val, curl_err, work);
+    json_decref(val);
+    return rc;
+}
+
 #define BLOCK_VERSION_CURRENT 6
 
 static bool gbt_work_decode(const json_t *val, struct work *work)
@@ -893,70 +1040,58 @@ static int share_result(int result, struct work *work, const char *reason)
     return 1;
 }
 
-static bool submit_upstream_work(CURL *curl, struct work *work)
+/* the share was found on an older block than the current work */
+static bool submit_prev_stale(const struct work *work)
 {
-    json_t *val, *res, *reason;
-    char s[JSON_BUF_LEN];
-    int i;
-    bool rc = false;
-
     /* pass if the previous hash is not the current previous hash */
     if (!submit_old && memcmp(&work->data[1], &g_work.data[1], 32)) {
         if (opt_debug)
             applog(LOG_DEBUG, "DEBUG: stale work detected, discarding");
         return true;
     }
+    return false;
+}
 
-    if (!have_stratum && allow_mininginfo) {
-        struct work wheight;
-        get_mininginfo(curl, &wheight);
-        if (work->height && work->height <= net_blocks) {
-            if (opt_debug)
-                applog(LOG_WARNING, "block %u was already solved", work->height);
-            return true;
-        }
+/* the wallet's last getmininginfo is past the share's block */
+static bool submit_height_stale(const struct work *work)
+{
+    if (work->height && work->height <= net_blocks) {
+        if (opt_debug)
+            applog(LOG_WARNING, "block %u was already solved", work->height);
+        return true;
     }
+    return false;
+}
 
-    if (have_stratum) {
-        uint32_t ntime, nonce;
-        char ntimestr[9], noncestr[9];
-
-        if (jsonrpc_2) {
-            uchar hash[32];
-
-            bin2hex(noncestr, (const unsigned char *)work->data + 39, 4);
-            char *hashhex = abin2hex(hash, 32);
-            snprintf(s, JSON_BUF_LEN,
-                    "{\"method\": \"submit\", \"params\": {\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"%s\", \"result\": \"%s\"}, \"id\":4}\r\n",
-                    rpc2_id, work->job_id, noncestr, hashhex);
-            free(hashhex);
-        } else {
-            char *xnonce2str;
-
-            le32enc(&ntime, work->data[17]);
-            le32enc(&nonce, work->data[19]);
+/* true when the share is not worth sending any more */
+static bool submit_upstream_stale(CURL *curl, struct work *work)
+{
+    if (submit_prev_stale(work))
+        return true;
 
-            bin2hex(ntimestr, (const unsigned char *)(&ntime), 4);
-            bin2hex(noncestr, (const unsigned char *)(&nonce), 4);
-            xnonce2str = abin2hex(work->xnonce2, work->xnonce2_len);
-            snprintf(s, JSON_BUF_LEN,
-                    "{\"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":4}",
-                    rpc_user, work->job_id, xnonce2str, ntimestr, noncestr);
-            free(xnonce2str);
-        }
+    if (!have_stratum && allow_mininginfo) {
+        get_mininginfo(curl, NULL);
+        return submit_height_stale(work);
+    }
+    return false;
+}
 
-        // store to keep/display solved blocs (work struct not linked on accept notification)
-        stratum.sharediff = work->sharediff;
+/* gbt and getwork shares go out as a plain JSON-RPC request over HTTP */
+static bool submit_over_http(const struct work *work)
+{
+    return !have_stratum && (work->txs || !jsonrpc_2);
+}
 
-        if (unlikely(!stratum_send_line(&stratum, s))) {
-            applog(LOG_ERR, "submit_upstream_work stratum_send_line failed");
-            goto out;
-        }
+/* the submitblock or getwork request for a share, NULL when out of memory */
+static char *submit_upstream_req(struct work *work)
+{
+    json_t *val;
+    char *req;
+    int i;
 
-    } else if (work->txs) { /* gbt */
+    if (work->txs) { /* gbt */
 
         char data_str[2 * sizeof(work->data) + 1];
-        char *req;
 
         for (i = 0; i < ARRAY_SIZE(work->data); i++)
             be32enc(work->data + i, work->data[i]);
@@ -968,25 +1103,54 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
             params = json_dumps(val, 0);
             json_decref(val);
             req = (char*) malloc(128 + 2 * 80 + strlen(work->txs) + strlen(params));
-            sprintf(req,
-                "{\"method\": \"submitblock\", \"params\": [\"%s%s\", %s], \"id\":4}\r\n",
-                data_str, work->txs, params);
+            if (req)
+                sprintf(req,
+                    "{\"method\": \"submitblock\", \"params\": [\"%s%s\", %s], \"id\":4}\r\n",
+                    data_str, work->txs, params);
             free(params);
         } else {
             req = (char*) malloc(128 + 2 * 80 + strlen(work->txs));
-            sprintf(req,
-                "{\"method\": \"submitblock\", \"params\": [\"%s%s\"], \"id\":4}\r\n",
-                data_str, work->txs);
+            if (req)
+                sprintf(req,
+                    "{\"method\": \"submitblock\", \"params\": [\"%s%s\"], \"id\":4}\r\n",
+                    data_str, work->txs);
         }
 
-        val = json_rpc_call(curl, rpc_url, rpc_userpass, req, NULL, 0);
-        free(req);
-        if (unlikely(!val)) {
-            applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
-            goto out;
-        }
+    } else {
 
-        res = json_object_get(val, "result");
+        char* gw_str = NULL;
+        int data_size = 128;
+        int adata_sz = data_size / sizeof(uint32_t);
+
+        /* build hex string */
+        for (i = 0; i < adata_sz; i++)
+            le32enc(&work->data[i], work->data[i]);
+
+        gw_str = abin2hex((uchar*)work->data, data_size);
+        if (unlikely(!gw_str))
+            return NULL;
+
+        //applog(LOG_WARNING, gw_str);
+
+        /* build JSON-RPC request */
+        req = (char*) malloc(JSON_BUF_LEN);
+        if (req)
+            snprintf(req, JSON_BUF_LEN,
+                "{\"method\": \"getwork\", \"params\": [\"%s\"], \"id\":4}\r\n", gw_str);
+        free(gw_str);
+    }
+
+    return req;
+}
+
+/* account for the server's answer to submit_upstream_req() */
+static void submit_upstream_res(struct work *work, json_t *val)
+{
+    json_t *res, *reason;
+
+    res = json_object_get(val, "result");
+
+    if (work->txs) { /* gbt */
         if (json_is_object(res)) {
             char *res_str;
             bool sumres = false;
@@ -1003,86 +1167,115 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
             free(res_str);
         } else
             share_result(json_is_null(res), work, json_string_value(res));
+    } else {
+        reason = json_object_get(val, "reject-reason");
+        share_result(json_is_true(res), work, reason ? json_string_value(reason) : NULL);
+    }
+}
 
-        json_decref(val);
+static bool submit_upstream_work(CURL *curl, struct work *work)
+{
+    json_t *val, *res;
+    char s[JSON_BUF_LEN];
+    bool rc = false;
 
-    } else {
+    if (submit_upstream_stale(curl, work))
+        return true;
 
-        char* gw_str = NULL;
-        int data_size = 128;
-        int adata_sz;
+    if (have_stratum) {
+        uint32_t ntime, nonce;
+        char ntimestr[9], noncestr[9];
 
         if (jsonrpc_2) {
-            char noncestr[9];
             uchar hash[32];
-            char *hashhex;
 
             bin2hex(noncestr, (const unsigned char *)work->data + 39, 4);
-
-            hashhex = abin2hex(&hash[0], 32);
+            char *hashhex = abin2hex(hash, 32);
             snprintf(s, JSON_BUF_LEN,
-                    "{\"method\": \"submit\", \"params\": "
-                        "{\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"%s\", \"result\": \"%s\"},"
-                    "\"id\":4}\r\n",
+                    "{\"method\": \"submit\", \"params\": {\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"%s\", \"result\": \"%s\"}, \"id\":4}\r\n",
                     rpc2_id, work->job_id, noncestr, hashhex);
             free(hashhex);
+        } else {
+            char *xnonce2str;
 
-            /* issue JSON-RPC request */
-            val = json_rpc2_call(curl, rpc_url, rpc_userpass, s, NULL, 0);
-            if (unlikely(!val)) {
-                applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
-                goto out;
-            }
-            res = json_object_get(val, "result");
-            json_t *status = json_object_get(res, "status");
-            bool valid = !strcmp(status ? json_string_value(status) : "", "OK");
-            if (valid)
-                share_result(valid, work, NULL);
-            else {
-                json_t *err = json_object_get(res, "error");
-                const char *sreason = json_string_value(json_object_get(err, "message"));
-                share_result(valid, work, sreason);
-                if (!strcasecmp("Invalid job id", sreason)) {
-                    work_free(work);
-                    work_copy(work, &g_work);
-                    g_work_time = 0;
-                    restart_threads();
-                }
-            }
-            json_decref(val);
-            return true;
+            le32enc(&ntime, work->data[17]);
+            le32enc(&nonce, work->data[19]);
 
+            bin2hex(ntimestr, (const unsigned char *)(&ntime), 4);
+            bin2hex(noncestr, (const unsigned char *)(&nonce), 4);
+            xnonce2str = abin2hex(work->xnonce2, work->xnonce2_len);
+            snprintf(s, JSON_BUF_LEN,
+                    "{\"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":4}",
+                    rpc_user, work->job_id, xnonce2str, ntimestr, noncestr);
+            free(xnonce2str);
         }
-        adata_sz = data_size / sizeof(uint32_t);
 
-        /* build hex string */
-        for (i = 0; i < adata_sz; i++)
-            le32enc(&work->data[i], work->data[i]);
+        // store to keep/display solved blocs (work struct not linked on accept notification)
+        stratum.sharediff = work->sharediff;
 
-        gw_str = abin2hex((uchar*)work->data, data_size);
+        if (unlikely(!stratum_send_line(&stratum, s))) {
+            applog(LOG_ERR, "submit_upstream_work stratum_send_line failed");
+            goto out;
+        }
 
-        if (unlikely(!gw_str)) {
+    } else if (submit_over_http(work)) {
+
+        char *req = submit_upstream_req(work);
+
+        if (unlikely(!req)) {
             applog(LOG_ERR, "submit_upstream_work OOM");
             return false;
         }
 
-        //applog(LOG_WARNING, gw_str);
+        /* issue JSON-RPC request */
+        val = json_rpc_call(curl, rpc_url, rpc_userpass, req, NULL, 0);
+        free(req);
+        if (unlikely(!val)) {
+            applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
+            goto out;
+        }
 
-        /* build JSON-RPC request */
+        submit_upstream_res(work, val);
+        json_decref(val);
+
+    } else {
+
+        char noncestr[9];
+        uchar hash[32];
+        char *hashhex;
+
+        bin2hex(noncestr, (const unsigned char *)work->data + 39, 4);
+
+        hashhex = abin2hex(&hash[0], 32);
         snprintf(s, JSON_BUF_LEN,
-            "{\"method\": \"getwork\", \"params\": [\"%s\"], \"id\":4}\r\n", gw_str);
-        free(gw_str);
+                "{\"method\": \"submit\", \"params\": "
+                    "{\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"%s\", \"result\": \"%s\"},"
+                "\"id\":4}\r\n",
+                rpc2_id, work->job_id, noncestr, hashhex);
+        free(hashhex);
 
         /* issue JSON-RPC request */
-        val = json_rpc_call(curl, rpc_url, rpc_userpass, s, NULL, 0);
+        val = json_rpc2_call(curl, rpc_url, rpc_userpass, s, NULL, 0);
         if (unlikely(!val)) {
             applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
             goto out;
         }
         res = json_object_get(val, "result");
-        reason = json_object_get(val, "reject-reason");
-        share_result(json_is_true(res), work, reason ? json_string_value(reason) : NULL);
-
+        json_t *status = json_object_get(res, "status");
+        bool valid = !strcmp(status ? json_string_value(status) : "", "OK");
+        if (valid)
+            share_result(valid, work, NULL);
+        else {
+            json_t *err = json_object_get(res, "error");
+            const char *sreason = json_string_value(json_object_get(err, "message"));
+            share_result(valid, work, sreason);
+            if (!strcasecmp("Invalid job id", sreason)) {
+                work_free(work);
+                work_copy(work, &g_work);
+                g_work_time = 0;
+                restart_threads();
+            }
+        }
         json_decref(val);
     }
 
@@ -1104,71 +1297,90 @@ static const char *gbt_lp_req =
     "{\"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": "
     GBT_CAPABILITIES ", \"longpollid\": \"%s\"}], \"id\":0}\r\n";
 
-static bool get_upstream_work(CURL *curl, struct work *work)
+/*
+ * Decode the answer to a work request: 1 when the work is ready, 0 when
+ * the request failed and -1 when it has to be sent again (gbt fell back
+ * to getwork).  Takes the reference to val.
+ */
+static int get_upstream_res(struct work *work, json_t *val, int err)
 {
-    json_t *val;
-    int err;
     bool rc;
-    struct timeval tv_start, tv_end, diff;
-
-start:
-    gettimeofday(&tv_start, NULL);
-
-    if (jsonrpc_2) {
-        char s[128];
-        snprintf(s, 128, "{\"method\": \"getjob\", \"params\": {\"id\": \"%s\"}, \"id\":1}\r\n", rpc2_id);
-        val = json_rpc2_call(curl, rpc_url, rpc_userpass, s, NULL, 0);
-    } else {
-        val = json_rpc_call(curl, rpc_url, rpc_userpass,
-                            have_gbt ? gbt_req : getwork_req,
-                            &err, have_gbt ? JSON_RPC_QUIET_404 : 0);
-    }
-    gettimeofday(&tv_end, NULL);
 
     if (have_stratum) {
         if (val)
             json_decref(val);
-        return true;
+        return 1;
     }
 
     if (!have_gbt && !allow_getwork) {
         applog(LOG_ERR, "No usable protocol");
         if (val)
             json_decref(val);
-        return false;
+        return 0;
     }
 
     if (have_gbt && allow_getwork && !val && err == CURLE_OK) {
         applog(LOG_NOTICE, "getblocktemplate failed, falling back to getwork");
         have_gbt = false;
-        goto start;
+        return -1;
     }
 
     if (!val)
-        return false;
+        return 0;
 
     if (have_gbt) {
         rc = gbt_work_decode(json_object_get(val, "result"), work);
         if (!have_gbt) {
             json_decref(val);
-            goto start;
+            return -1;
         }
     } else {
         rc = work_decode(json_object_get(val, "result"), work);
     }
 
-    if (opt_protocol && rc) {
+    json_decref(val);
+    return rc ? 1 : 0;
+}
+
+static bool get_upstream_work(CURL *curl, struct work *work)
+{
+    json_t *val;
+    int err, rc;
+    struct timeval tv_start, tv_end, diff;
+
+    do {
+        gettimeofday(&tv_start, NULL);
+
+        if (jsonrpc_2) {
+            char s[128];
+            snprintf(s, 128, "{\"method\": \"getjob\", \"params\": {\"id\": \"%s\"}, \"id\":1}\r\n", rpc2_id);
+            val = json_rpc2_call(curl, rpc_url, rpc_userpass, s, NULL, 0);
+        } else {
+            val = json_rpc_call(curl, rpc_url, rpc_userpass,
+                                have_gbt ? gbt_req : getwork_req,
+                                &err, have_gbt ? JSON_RPC_QUIET_404 : 0);
+        }
+        gettimeofday(&tv_end, NULL);
+
+        rc = get_upstream_res(work, val, err);
+    } while (rc < 0);
+
+    if (have_stratum)
+        return true;
+
+    if (!rc)
+        return false;
+
+    if (opt_protocol) {
         timeval_subtract(&diff, &tv_end, &tv_start);
         applog(LOG_DEBUG, "got new work in %.2f ms",
                (1000.0 * diff.tv_sec) + (0.001 * diff.tv_usec));
     }
 
-    json_decref(val);
-
     // store work height in solo
     get_mininginfo(curl, work);
 
-    return rc;
+    return true;
 }
 
 static void workio_cmd_free(struct workio_cmd *wc)
@@ -1274,54 +1486,361 @@ bool rpc2_login(CURL *curl)
         goto end;
     }
 
-    if (opt_debug && rc) {
-        timeval_subtract(&diff, &tv_end, &tv_start);
-        applog(LOG_DEBUG, "DEBUG: authenticated in %d ms",
-                diff.tv_sec * 1000 + diff.tv_usec / 1000);
+    if (opt_debug && rc) {
+        timeval_subtract(&diff, &tv_end, &tv_start);
+        applog(LOG_DEBUG, "DEBUG: authenticated in %d ms",
+                diff.tv_sec * 1000 + diff.tv_usec / 1000);
+    }
+
+    json_decref(val);
+end:
+    return rc;
+}
+
+bool rpc2_workio_login(CURL *curl)
+{
+    int failures = 0;
+    if (opt_benchmark)
+        return true;
+    /* submit solution to bitcoin via JSON-RPC */
+    pthread_mutex_lock(&rpc2_login_lock);
+    while (!rpc2_login(curl)) {
+        if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
+            applog(LOG_ERR, "...terminating workio thread");
+            pthread_mutex_unlock(&rpc2_login_lock);
+            return false;
+        }
+
+        /* pause, then restart work-request loop */
+        if (!opt_benchmark)
+            applog(LOG_ERR, "...retry after %d seconds", opt_fail_pause);
+        sleep(opt_fail_pause);
+        pthread_mutex_unlock(&rpc2_login_lock);
+        pthread_mutex_lock(&rpc2_login_lock);
+    }
+    pthread_mutex_unlock(&rpc2_login_lock);
+
+    return true;
+}
+
+/*
+ * gbt and getwork requests run side by side on one curl multi handle, so
+ * a share goes out as soon as it is found instead of queueing behind a
+ * work fetch (or a slow submit), and each transfer has its own timeout.
+ * Stratum shares and the JSON-RPC 2.0 getjob protocol keep the blocking
+ * calls on the thread's easy handle. When the wallet has getmininginfo,
+ * a request asks it first on its own handle: a fetched work waits for it
+ * to learn its block height, a share to be checked against the wallet's.
+ */
+#define WORKIO_TIMEOUT 30 /* seconds, per request */
+
+struct workio_req {
+    struct workio_cmd *wc;
+    struct work *work;      /* WC_GET_WORK: the work being fetched */
+    char *rpc_req;          /* WC_SUBMIT_WORK: kept for the retries */
+    CURL *curl;
+    struct json_rpc_req *rpc;
+    struct timeval tv_start;
+    time_t retry_at;        /* 0 while in flight */
+    int failures;
+    bool info;              /* getmininginfo goes or went out first */
+    bool done;
+    struct workio_req *next;
+};
+
+static CURLM * volatile workio_multi = NULL;
+
+/* let the workio thread pick a new command up while it polls its sockets */
+static void workio_wakeup(void)
+{
+#if LIBCURL_VERSION_NUM >= 0x074400
+    CURLM *multi = workio_multi;
+    if (multi)
+        curl_multi_wakeup(multi);
+#endif
+}
+
+static bool workio_async(const struct workio_cmd *wc)
+{
+    if (wc->cmd == WC_GET_WORK)
+        return !jsonrpc_2 && !have_stratum;
+    return submit_over_http(wc->u.work);
+}
+
+static bool workio_send(CURLM *multi, struct workio_req *req)
+{
+    const char *rpc_req = req->rpc_req;
+    int flags = 0;
+
+    if (req->info)
+        rpc_req = info_req;
+    else if (req->wc->cmd == WC_GET_WORK) {
+        rpc_req = have_gbt ? gbt_req : getwork_req;
+        flags = have_gbt ? JSON_RPC_QUIET_404 : 0;
+    }
+
+    req->rpc = json_rpc_begin(req->curl, rpc_url, rpc_userpass, rpc_req,
+                              flags, WORKIO_TIMEOUT);
+    if (unlikely(!req->rpc))
+        return false;
+    curl_easy_setopt(req->curl, CURLOPT_PRIVATE, req);
+    gettimeofday(&req->tv_start, NULL);
+    req->retry_at = 0;
+    curl_multi_add_handle(multi, req->curl);
+    return true;
+}
+
+/* pause a failed request before the next attempt, false once out of retries */
+static bool workio_failed(struct workio_req *req)
+{
+    bool get = (req->wc->cmd == WC_GET_WORK);
+
+    if (unlikely((opt_retries >= 0) && (++req->failures > opt_retries))) {
+        applog(LOG_ERR, get ? "json_rpc_call failed, terminating workio thread"
+                            : "...terminating workio thread");
+        return false;
+    }
+
+    /* pause, then restart work-request loop */
+    if (get)
+        applog(LOG_ERR, "json_rpc_call failed, retry after %d seconds",
+            opt_fail_pause);
+    else if (!opt_benchmark)
+        applog(LOG_ERR, "...retry after %d seconds", opt_fail_pause);
+    req->retry_at = time(NULL) + max(opt_fail_pause, 1);
+    return true;
+}
+
+static void workio_req_free(CURLM *multi, struct workio_req *req)
+{
+    if (req->rpc) {
+        curl_multi_remove_handle(multi, req->curl);
+        json_decref(json_rpc_end(req->rpc, CURLE_ABORTED_BY_CALLBACK, NULL));
+    }
+    if (req->curl)
+        curl_easy_cleanup(req->curl);
+    if (req->work) {
+        work_free(req->work);
+        free(req->work);
+    }
+    free(req->rpc_req);
+    workio_cmd_free(req->wc);
+    free(req);
+}
+
+/* queue a command, false when the workio thread has to stop */
+static bool workio_start(CURLM *multi, CURL *curl, struct workio_cmd *wc,
+                         struct workio_req **reqs)
+{
+    struct workio_req *req;
+    bool ok = true;
+
+    if (!workio_async(wc)) {
+        switch (wc->cmd) {
+        case WC_GET_WORK:
+            ok = workio_get_work(wc, curl);
+            break;
+        case WC_SUBMIT_WORK:
+            ok = workio_submit_work(wc, curl);
+            break;
+
+        default:		/* should never happen */
+            ok = false;
+            break;
+        }
+        workio_cmd_free(wc);
+        return ok;
+    }
+
+    if (wc->cmd == WC_SUBMIT_WORK && submit_prev_stale(wc->u.work)) {
+        workio_cmd_free(wc);
+        return true;
+    }
+
+    req = (struct workio_req *) calloc(1, sizeof(*req));
+    if (!req) {
+        workio_cmd_free(wc);
+        return false;
+    }
+    req->wc = wc;
+    req->curl = curl_easy_init();
+    if (wc->cmd == WC_GET_WORK)
+        req->work = (struct work *) calloc(1, sizeof(*req->work));
+    else
+        req->rpc_req = submit_upstream_req(wc->u.work);
+    if (unlikely(!req->curl || !(req->work || req->rpc_req))) {
+        applog(LOG_ERR, "workio request OOM");
+        workio_req_free(multi, req);
+        return false;
+    }
+
+    req->next = *reqs;
+    *reqs = req;
+
+    req->info = (wc->cmd == WC_SUBMIT_WORK) && mininginfo_wanted();
+    if (!workio_send(multi, req))
+        return workio_failed(req);
+    return true;
+}
+
+/* send work to requesting thread */
+static bool workio_got_work(struct workio_req *req)
+{
+    if (tq_push(req->wc->thr->q, req->work))
+        req->work = NULL;
+    req->done = true;
+    return true;
+}
+
+/* a transfer is over, false when the workio thread has to stop */
+static bool workio_done(CURLM *multi, struct workio_req *req, CURLcode result)
+{
+    struct rpc_stats *st;
+    struct timeval tv_end, diff;
+    const char *what;
+    json_t *val;
+    double ms;
+    int err = 0, rc;
+
+    gettimeofday(&tv_end, NULL);
+    timeval_subtract(&diff, &tv_end, &req->tv_start);
+    ms = (1000.0 * diff.tv_sec) + (0.001 * diff.tv_usec);
+
+    curl_multi_remove_handle(multi, req->curl);
+    val = json_rpc_end(req->rpc, result, &err);
+    req->rpc = NULL;
+
+    if (req->info) {
+        /* a failed getmininginfo only leaves the height unknown */
+        req->info = false;
+        mininginfo_decode(val, err, req->wc->cmd == WC_GET_WORK ? req->work : NULL);
+        json_decref(val);
+        if (req->wc->cmd == WC_GET_WORK)
+            return workio_got_work(req);
+        if (submit_height_stale(req->wc->u.work)) {
+            req->done = true;
+            return true;
+        }
+        return workio_send(multi, req) || workio_failed(req);
+    }
+
+    if (req->wc->cmd == WC_GET_WORK) {
+        st = &getwork_stats;
+        what = have_gbt ? "getblocktemplate" : "getwork";
+    } else {
+        st = &submit_stats;
+        what = req->wc->u.work->txs ? "submitblock" : "getwork submit";
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    st->count++;
+    if (!val)
+        st->failed++;
+    st->total_ms += ms;
+    if (ms > st->max_ms)
+        st->max_ms = ms;
+    pthread_mutex_unlock(&stats_lock);
+    if (opt_debug)
+        applog(LOG_DEBUG, "%s %s in %.1f ms", what, val ? "answered" : "failed", ms);
+
+    if (req->wc->cmd == WC_SUBMIT_WORK) {
+        if (unlikely(!val)) {
+            applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
+            return workio_failed(req);
+        }
+        submit_upstream_res(req->wc->u.work, val);
+        json_decref(val);
+        req->done = true;
+        return true;
     }
 
-    json_decref(val);
-end:
-    return rc;
+    rc = get_upstream_res(req->work, val, err);
+    if (rc < 0)
+        return workio_send(multi, req) || workio_failed(req);
+    if (!rc)
+        return workio_failed(req);
+
+    // store work height in solo
+    if (mininginfo_wanted()) {
+        req->info = true;
+        if (workio_send(multi, req))
+            return true;
+        req->info = false;
+    }
+    return workio_got_work(req);
 }
 
-bool rpc2_workio_login(CURL *curl)
+/* move the transfers on and wait for the next event, at most a second */
+static bool workio_run(CURLM *multi, struct workio_req **reqs)
 {
-    int failures = 0;
-    if (opt_benchmark)
-        return true;
-    /* submit solution to bitcoin via JSON-RPC */
-    pthread_mutex_lock(&rpc2_login_lock);
-    while (!rpc2_login(curl)) {
-        if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
-            applog(LOG_ERR, "...terminating workio thread");
-            pthread_mutex_unlock(&rpc2_login_lock);
-            return false;
+    struct workio_req **p, *req;
+    time_t now = time(NULL);
+    int running, left, numfds;
+    CURLMsg *msg;
+
+    for (req = *reqs; req; req = req->next) {
+        if (!req->retry_at || req->retry_at > now)
+            continue;
+        if (req->wc->cmd == WC_SUBMIT_WORK) {
+            if (submit_prev_stale(req->wc->u.work)) {
+                req->done = true;
+                continue;
+            }
+            req->info = mininginfo_wanted();
         }
+        if (!workio_send(multi, req) && !workio_failed(req))
+            return false;
+    }
 
-        /* pause, then restart work-request loop */
-        if (!opt_benchmark)
-            applog(LOG_ERR, "...retry after %d seconds", opt_fail_pause);
-        sleep(opt_fail_pause);
-        pthread_mutex_unlock(&rpc2_login_lock);
-        pthread_mutex_lock(&rpc2_login_lock);
+    curl_multi_perform(multi, &running);
+    while ((msg = curl_multi_info_read(multi, &left))) {
+        CURLcode result = msg->data.result;
+        char *priv = NULL;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+        if (!workio_done(multi, (struct workio_req *) priv, result))
+            return false;
     }
-    pthread_mutex_unlock(&rpc2_login_lock);
 
+    for (p = reqs; *p; ) {
+        req = *p;
+        if (req->done) {
+            *p = req->next;
+            workio_req_free(multi, req);
+        } else
+            p = &req->next;
+    }
+    if (!*reqs)
+        return true;
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+    curl_multi_poll(multi, NULL, 0, 1000, &numfds);
+#else
+    curl_multi_wait(multi, NULL, 0, 100, &numfds);
+    if (!numfds)
+        usleep(100 * 1000);
+#endif
     return true;
 }
 
 static void *workio_thread(void *userdata)
 {
     struct thr_info *mythr = (struct thr_info *) userdata;
+    const struct timespec now = { 0, 0 }; /* long gone, tq_pop() returns at once */
+    struct workio_req *reqs = NULL;
+    CURLM *multi;
     CURL *curl;
     bool ok = true;
 
     curl = curl_easy_init();
-    if (unlikely(!curl)) {
+    multi = curl_multi_init();
+    if (unlikely(!curl || !multi)) {
         applog(LOG_ERR, "CURL initialization failed");
         return NULL;
     }
+    workio_multi = multi;
 
     if(jsonrpc_2 && !have_stratum) {
         ok = rpc2_workio_login(curl);
@@ -1330,31 +1849,31 @@ static void *workio_thread(void *userdata)
     while (ok) {
         struct workio_cmd *wc;
 
-        /* wait for workio_cmd sent to us, on our queue */
-        wc = (struct workio_cmd *) tq_pop(mythr->q, NULL);
-        if (!wc) {
+        /* wait for workio_cmd sent to us, on our queue, while nothing is in flight */
+        wc = (struct workio_cmd *) tq_pop(mythr->q, reqs ? &now : NULL);
+        if (!wc && !reqs) {
             ok = false;
             break;
         }
 
         /* process workio_cmd */
-        switch (wc->cmd) {
-        case WC_GET_WORK:
-            ok = workio_get_work(wc, curl);
-            break;
-        case WC_SUBMIT_WORK:
-            ok = workio_submit_work(wc, curl);
-            break;
-
-        default:		/* should never happen */
-            ok = false;
-            break;
+        while (wc && ok) {
+            ok = workio_start(multi, curl, wc, &reqs);
+            if (ok)
+                wc = (struct workio_cmd *) tq_pop(mythr->q, &now);
         }
 
-        workio_cmd_free(wc);
+        if (ok && reqs)
+            ok = workio_run(multi, &reqs);
     }
 
     tq_freeze(mythr->q);
+    while (reqs) {
+        struct workio_req *req = reqs;
+        reqs = req->next;
+        workio_req_free(multi, req);
+    }
+    /* the multi handle is left to the process exit, miners may still wake it */
     curl_easy_cleanup(curl);
 
     return NULL;
@@ -1390,6 +1909,7 @@ static bool get_work(struct thr_info *thr, struct work *work)
         workio_cmd_free(wc);
         return false;
     }
+    workio_wakeup();
 
     /* wait for response, a unit of work */
     work_heap = (struct work*) tq_pop(thr->q, NULL);
@@ -1423,6 +1943,7 @@ static bool submit_work(struct thr_info *thr, const struct work *work_in)
     /* send solution to workio thread */
     if (!tq_push(thr_info[work_thr_id].q, wc))
         goto err_out;
+    workio_wakeup();
 
     return true;
 
@@ -1542,19 +2063,375 @@ static bool wanna_mine(int thr_id)
     return state;
 }
 
+/*
+ * Nonce dispenser. The 2^32 nonces of a job go out in chunks from one
+ * counter, to whichever thread asks first: a thread claims what it can
+ * hash in a scan time, in whole batches of its lanes, so that the
+ * oneway threads and the default ones all keep busy until the job is
+ * done, with no nonce scanned twice. Chunks shrink as the job runs out
+ * (guided self-scheduling), the last ones go to whoever is idle, and
+ * a tail shorter than the claimer's batch rides along in its last one,
+ * whose lanes past the end scanhash_scrypt() leaves unreported.
+ *
+ * The state packs the job generation over the count of nonces handed
+ * out, so that a claim is one compare-and-swap, which fails for good
+ * once the job changes. A new job resets it under g_work_lock.
+ */
+#define NONCE_GEN_SHIFT 40
+#define NONCE_SPACE (1ULL << 32)
+
+#ifdef _MSC_VER
+#define nonce_cas(p, o, n) ((uint64_t) InterlockedCompareExchange64((volatile LONG64 *)(p), (LONG64)(n), (LONG64)(o)) == (o))
+#define mem_barrier() MemoryBarrier()
+#else
+#define nonce_cas(p, o, n) __sync_bool_compare_and_swap(p, o, n)
+#define mem_barrier() __sync_synchronize()
+#endif
+
+static volatile uint64_t nonce_state;
+static uint32_t nonce_gen;
+static uint32_t nonce_base;    /* nonce of the first one handed out */
+static uint32_t nonce_align;   /* default lanes, chunks are multiples of it */
+static uint32_t nonce_key[48]; /* g_work.data the counter is for */
+
+/* --randomize: splitmix64, seeded with the time and the pid on first use */
+static uint64_t nonce_rand_state;
+
+static uint64_t nonce_rand(void)
+{
+    uint64_t z;
+
+    if (!nonce_rand_state) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+#ifdef _MSC_VER
+        nonce_rand_state = (uint64_t) GetCurrentProcessId() << 40;
+#else
+        nonce_rand_state = (uint64_t) getpid() << 40;
+#endif
+        nonce_rand_state ^= ((uint64_t) tv.tv_sec << 20) ^ (uint64_t) tv.tv_usec;
+    }
+    z = (nonce_rand_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+struct nonce_job {
+    volatile uint64_t *state;  /* nonce_state, or a thread's own counter */
+    uint32_t gen;
+    uint32_t base;
+    uint32_t align;
+};
+
+/* the dispenser for g_work, a new one if it changed; g_work_lock held */
+static void nonce_job_enter(struct nonce_job *job)
+{
+    uint64_t state;
+
+    if (!nonce_gen || memcmp(nonce_key, g_work.data, sizeof(nonce_key))) {
+        memcpy(nonce_key, g_work.data, sizeof(nonce_key));
+        nonce_align = scrypt_get_lanes();
+        nonce_base = 0;
+        if (opt_randomize) {
+            /* the wrap at 2^32 stays on a chunk boundary */
+            uint32_t r = (uint32_t) (nonce_rand() >> 32);
+            nonce_base = 0U - r / nonce_align * nonce_align;
+        }
+        nonce_gen = (nonce_gen + 1) & 0xffffff;
+        if (!nonce_gen)
+            nonce_gen = 1;
+        do {
+            state = nonce_state;
+        } while (!nonce_cas(&nonce_state, state, (uint64_t) nonce_gen << NONCE_GEN_SHIFT));
+    }
+    job->state = &nonce_state;
+    job->gen = nonce_gen;
+    job->base = nonce_base;
+    job->align = nonce_align;
+}
+
+/* a job for a header of the thread's own, all 2^32 nonces in *state */
+static void nonce_job_own(struct nonce_job *job, volatile uint64_t *state, uint32_t align)
+{
+    *state = 1ULL << NONCE_GEN_SHIFT;
+    job->state = state;
+    job->gen = 1;
+    job->base = 0;
+    job->align = align;
+}
+
+/* true if g_work is still the job the counter is for; g_work_lock held */
+static bool nonce_job_current(const struct nonce_job *job)
+{
+    return job->state == &nonce_state && job->gen == nonce_gen &&
+        !memcmp(nonce_key, g_work.data, sizeof(nonce_key));
+}
+
+/*
+ * Claims up to "want" nonces of job, in batches of "lanes", for one of
+ * "threads". Returns the count, 0 once the job has none left for it.
+ */
+static uint32_t nonce_claim(const struct nonce_job *job, uint64_t want, int lanes,
+    int threads, uint32_t *first)
+{
+    uint64_t state, taken, end, size;
+
+    do {
+        state = *job->state;
+        if ((uint32_t) (state >> NONCE_GEN_SHIFT) != job->gen)
+            return 0;
+        taken = state & ((1ULL << NONCE_GEN_SHIFT) - 1);
+        /* no chunk across the wrap, scanhash counts up */
+        end = taken < NONCE_SPACE - job->base ? NONCE_SPACE - job->base : NONCE_SPACE;
+        size = (NONCE_SPACE - taken) / (2 * threads);
+        if (want > size)
+            want = size;
+        want = (want + job->align - 1) / job->align * job->align;
+        if (!want)
+            want = job->align;
+        size = end - taken < want ? end - taken : want;
+        /* whole batches, or all that is left when less than one would remain */
+        if (end - taken - size < (uint64_t) lanes)
+            size = end - taken;
+        else
+            size -= size % lanes;
+        if (!size)
+            return 0;
+    } while (!nonce_cas(job->state, state, state + size));
+
+    *first = job->base + (uint32_t) taken;
+    return (uint32_t) size;
+}
+
+/*
+ * Miner thread wakeups. A thread waiting for its first job, for a stale
+ * job to be replaced or for a mining condition to clear sleeps on
+ * work_event_cond until new work is published or the threads are
+ * restarted. The event count keeps a wakeup sent between the check and
+ * the wait; the timeout is only for what has no event, the temperature.
+ */
+static pthread_mutex_t work_event_lock;
+static pthread_cond_t work_event_cond;
+static volatile uint32_t work_events;
+
+static void work_event_signal(void)
+{
+    pthread_mutex_lock(&work_event_lock);
+    work_events++;
+    pthread_cond_broadcast(&work_event_cond);
+    pthread_mutex_unlock(&work_event_lock);
+}
+
+/* waits up to secs for an event past the count "seen" */
+static void work_event_wait(uint32_t seen, int secs)
+{
+    struct timeval now;
+    struct timespec abstime;
+
+    gettimeofday(&now, NULL);
+    abstime.tv_sec = now.tv_sec + secs;
+    abstime.tv_nsec = now.tv_usec * 1000;
+    pthread_mutex_lock(&work_event_lock);
+    while (work_events == seen)
+        if (pthread_cond_timedwait(&work_event_cond, &work_event_lock, &abstime))
+            break;
+    pthread_mutex_unlock(&work_event_lock);
+}
+
+/*
+ * Work publication. Whoever changes g_work, under g_work_lock, then
+ * publishes an immutable copy of it, with its nonce job. A miner thread
+ * picks the current one up with one pointer load and, if it changed,
+ * one memcpy of it: the strings stay the snapshot's, no lock and no
+ * allocation on the miner side. Each thread keeps the snapshot it holds
+ * in work_restart[].work, a hazard pointer: a publish only frees the
+ * old snapshots that no thread holds any more.
+ */
+struct work_snap {
+    struct work work;
+    struct nonce_job job;
+    /* stratum: what the miner threads build their own headers from */
+    unsigned char *coinbase;
+    size_t coinbase_size;
+    size_t xnonce2_off;
+    int merkle_count;
+    unsigned char *merkle;
+    struct work_snap *next;
+};
+
+static struct work_snap * volatile work_current;
+static struct work_snap *work_retired; /* g_work_lock */
+
+static bool work_held(const struct work_snap *snap)
+{
+    int i;
+
+    for (i = 0; i < opt_n_total_threads; i++)
+        if (work_restart[i].work == snap)
+            return true;
+    return false;
+}
+
+/* the coinbase and merkle branch of the stratum job of snap */
+static void work_snap_stratum(struct work_snap *snap)
+{
+    struct stratum_job *job = &stratum.job;
+    int i;
+
+    pthread_mutex_lock(&stratum.work_lock);
+    if (job->job_id && !strcmp(job->job_id, snap->work.job_id) &&
+        snap->work.xnonce2_len == stratum.xnonce2_size) {
+        snap->coinbase = (uchar*) malloc(job->coinbase_size);
+        snap->merkle = (uchar*) malloc(32 * job->merkle_count + 1);
+        if (snap->coinbase && snap->merkle) {
+            memcpy(snap->coinbase, job->coinbase, job->coinbase_size);
+            snap->coinbase_size = job->coinbase_size;
+            snap->xnonce2_off = job->xnonce2 - job->coinbase;
+            for (i = 0; i < job->merkle_count; i++)
+                memcpy(snap->merkle + 32 * i, job->merkle[i], 32);
+            snap->merkle_count = job->merkle_count;
+        } else {
+            free(snap->coinbase);
+            snap->coinbase = NULL;
+        }
+    }
+    pthread_mutex_unlock(&stratum.work_lock);
+}
+
+/* publishes g_work to the miner threads; g_work_lock held */
+static void work_publish(void)
+{
+    struct work_snap *snap, **prev;
+
+    snap = (struct work_snap *) calloc(1, sizeof(*snap));
+    if (!snap) {
+        applog(LOG_ERR, "work publication failed, out of memory");
+        return;
+    }
+    work_copy(&snap->work, &g_work);
+    nonce_job_enter(&snap->job);
+    if (have_stratum && !jsonrpc_2 && g_work.job_id)
+        work_snap_stratum(snap);
+
+    if (work_current) {
+        work_current->next = work_retired;
+        work_retired = work_current;
+    }
+    mem_barrier();
+    work_current = snap;
+    mem_barrier();
+    work_event_signal();
+
+    for (prev = &work_retired; *prev; ) {
+        struct work_snap *old = *prev;
+        if (work_held(old)) {
+            prev = &old->next;
+            continue;
+        }
+        *prev = old->next;
+        work_free(&old->work);
+        free(old->coinbase);
+        free(old->merkle);
+        free(old);
+    }
+}
+
+/*
+ * Extranonce2 rolling. With stratum, each miner thread builds headers of
+ * its own from the snapshot's coinbase and merkle branch, no lock taken:
+ * the top bits of extranonce2 are thr_id + 1, 0 being the stratum
+ * thread's, and the others count the thread's headers. Each header has
+ * all of its 2^32 nonces for the thread alone.
+ */
+struct xnonce2_roll {
+    uint64_t count;
+    unsigned char xnonce2[16];
+    unsigned char *coinbase;
+    size_t size;
+};
+
+/* the next header of thr_id into work, false if snap cannot have any */
+static bool work_roll_header(struct work *work, const struct work_snap *snap, int thr_id,
+    struct xnonce2_roll *roll)
+{
+    size_t len = snap->work.xnonce2_len, n = len < 8 ? len : 8;
+    int bits = 8 * (int) n, slot = 1, i;
+    uchar merkle_root[64];
+    uint64_t v;
+
+    if (!snap->coinbase || len > sizeof(roll->xnonce2))
+        return false;
+    while ((1 << slot) <= opt_n_total_threads)
+        slot++;
+    if (bits - slot < 8)
+        return false;
+    if (roll->size < snap->coinbase_size) {
+        uchar *p = (uchar*) realloc(roll->coinbase, snap->coinbase_size);
+        if (!p)
+            return false;
+        roll->coinbase = p;
+        roll->size = snap->coinbase_size;
+    }
+
+    v = (uint64_t) (thr_id + 1) << (bits - slot);
+    v |= roll->count++ & ((1ULL << (bits - slot)) - 1);
+    memcpy(roll->xnonce2, snap->work.xnonce2, len);
+    for (i = 0; i < (int) n; i++)
+        roll->xnonce2[i] = (uchar) (v >> (8 * i));
+
+    memcpy(roll->coinbase, snap->coinbase, snap->coinbase_size);
+    memcpy(roll->coinbase + snap->xnonce2_off, roll->xnonce2, len);
+    sha256d(merkle_root, roll->coinbase, (int) snap->coinbase_size);
+    for (i = 0; i < snap->merkle_count; i++) {
+        memcpy(merkle_root + 32, snap->merkle + 32 * i, 32);
+        sha256d(merkle_root, merkle_root, 64);
+    }
+    for (i = 0; i < 8; i++)
+        work->data[9 + i] = be32dec((uint32_t *) merkle_root + i);
+    work->xnonce2 = roll->xnonce2;
+    return true;
+}
+
+/* the current snapshot, held by thr_id until its next call */
+static const struct work_snap *work_pickup(int thr_id)
+{
+    struct work_snap *snap = work_current;
+
+    if (snap == work_restart[thr_id].work)
+        return snap;
+    do {
+        snap = work_current;
+        work_restart[thr_id].work = snap;
+        mem_barrier();
+    } while (snap != work_current);
+    return snap;
+}
+
 static void *miner_thread(void *userdata)
 {
     struct thr_info *mythr = (struct thr_info *) userdata;
     int thr_id = mythr->id;
     struct work work;
     uint32_t max_nonce;
-    uint32_t end_nonce = 0xffffffffU / opt_n_total_threads * (thr_id + 1) - 0x20;
+    const struct work_snap *snap, *held = NULL;
+    struct nonce_job job = { 0 };
+    struct xnonce2_roll roll = { 0 };
+    volatile uint64_t own_nonces = 0;
+    bool own = false;
+    uint32_t next_nonce = 0, chunk_left = 0, chunk_gen = 0;
+    uint32_t ahead_first = 0, ahead_left = 0, ahead_gen = 0;
+    int lanes = mythr->forceThroughput == -1 ? scrypt_get_lanes() : mythr->forceThroughput;
+    bool pipelined = scrypt_pipelined(mythr->forceThroughput);
+    bool regen_work = false;
     time_t firstwork_time = 0;
     unsigned char *scratchbuf = NULL;
+    uint32_t scratch_n = opt_scrypt_n;
     char s[16];
     int i;
 
     memset(&work, 0, sizeof(work));
+    work.N = opt_scrypt_n;
 
     /* Set worker threads to nice 19 and then preferentially to SCHED_IDLE
      * and if that fails, then SCHED_BATCH. No need for this to be an
@@ -1650,92 +2527,147 @@ static void *miner_thread(void *userdata)
 
         }
     }
+#ifdef __linux__
+    if (use_affinity_mask == 0 && !opt_no_numa && numa_node_count() > 1) {
+        int node = thread_numa_node(thr_id);
+        if (opt_debug)
+            applog(LOG_DEBUG, "Binding thread %d to NUMA node %d", thr_id, node);
+        affine_to_node(thr_id, node);
+    }
+#endif
 
-        scratchbuf = scrypt_buffer_alloc(opt_scrypt_n, mythr->forceThroughput);
+        scratchbuf = scrypt_arena_slice(thr_id);
         if (!scratchbuf) {
             applog(LOG_ERR, "scrypt buffer allocation failed");
             pthread_mutex_lock(&applog_lock);
             exit(1);
         }
+        mythr->cpu.pages = scrypt_buffer_pages(scratchbuf);
+        mythr->cpu.numa_local = scrypt_buffer_numa(scratchbuf, &mythr->cpu.numa_node);
+        if (mythr->cpu.numa_node < 0)
+            applog(LOG_INFO, "Thread %d: scratchpad on %s pages", thr_id, mythr->cpu.pages);
+        else if (mythr->cpu.numa_local >= 0)
+            applog(LOG_INFO, "Thread %d: scratchpad on %s pages, node %d, %d%% local", thr_id,
+                mythr->cpu.pages, mythr->cpu.numa_node, mythr->cpu.numa_local);
 
     while (1) {
         uint64_t hashes_done;
         struct timeval tv_start, tv_end, diff;
         int64_t max64;
-        bool regen_work = false;
-        int wkcmp_offset = 0;
+        uint32_t seen;
         int nonce_oft = 19*sizeof(uint32_t); // 76
-        int wkcmp_sz = nonce_oft;
         int rc = 0;
 
         if (jsonrpc_2) {
-            wkcmp_sz = nonce_oft = 39;
+            nonce_oft = 39;
         }
 
         uint32_t *nonceptr = (uint32_t*) (((char*)work.data) + nonce_oft);
 
         if (have_stratum) {
-            while (!jsonrpc_2 && time(NULL) >= g_work_time + 120)
-                sleep(1);
-
-            pthread_mutex_lock(&g_work_lock);
+            /* no job for two minutes, the connection is down */
+            for (;;) {
+                uint32_t seen = work_events;
+                if (jsonrpc_2 || time(NULL) < g_work_time + 120)
+                    break;
+                work_event_wait(seen, 5);
+            }
 
-            // to clean: is g_work loaded before the memcmp ?
-            regen_work = regen_work || ( (*nonceptr) >= end_nonce
-                && !( memcmp(&work.data[wkcmp_offset], &g_work.data[wkcmp_offset], wkcmp_sz) ||
-                 jsonrpc_2 ? memcmp(((uint8_t*) work.data) + 43, ((uint8_t*) g_work.data) + 43, 33) : 0));
+            /* the job ran out of nonces, unless another thread saw it first */
             if (regen_work) {
-                stratum_gen_work(&stratum, &g_work);
+                pthread_mutex_lock(&g_work_lock);
+                if (nonce_job_current(&job)) {
+                    stratum_gen_work(&stratum, &g_work);
+                    work_publish();
+                }
+                pthread_mutex_unlock(&g_work_lock);
             }
 
         } else {
 
             int min_scantime = have_longpoll ? LP_SCANTIME : opt_scantime;
             /* obtain new work from internal workio thread */
-            pthread_mutex_lock(&g_work_lock);
-            if (!have_stratum &&
-                (time(NULL) - g_work_time >= min_scantime ||
-                 work.data[19] >= end_nonce)) {
-                if (unlikely(!get_work(mythr, &g_work))) {
-                    applog(LOG_ERR, "work retrieval failed, exiting "
-                        "mining thread %d", mythr->id);
-                    pthread_mutex_unlock(&g_work_lock);
-                    goto out;
+            if (time(NULL) - g_work_time >= min_scantime || regen_work) {
+                pthread_mutex_lock(&g_work_lock);
+                if (!have_stratum &&
+                    (time(NULL) - g_work_time >= min_scantime ||
+                     (regen_work && nonce_job_current(&job)))) {
+                    if (unlikely(!get_work(mythr, &g_work))) {
+                        applog(LOG_ERR, "work retrieval failed, exiting "
+                            "mining thread %d", mythr->id);
+                        pthread_mutex_unlock(&g_work_lock);
+                        goto out;
+                    }
+                    g_work_time = have_stratum ? 0 : time(NULL);
+                    work_publish();
                 }
-                g_work_time = have_stratum ? 0 : time(NULL);
-            }
-            if (have_stratum) {
                 pthread_mutex_unlock(&g_work_lock);
-                continue;
             }
+            if (have_stratum)
+                continue;
         }
-        if (memcmp(&work.data[wkcmp_offset], &g_work.data[wkcmp_offset], wkcmp_sz) ||
-            jsonrpc_2 ? memcmp(((uint8_t*) work.data) + 43, ((uint8_t*) g_work.data) + 43, 33) : 0)
-        {
-            work_free(&work);
-            work_copy(&work, &g_work);
-            nonceptr = (uint32_t*) (((char*)work.data) + nonce_oft);
-            *nonceptr = 0xffffffffU / opt_n_total_threads * thr_id;
-            if (opt_randomize)
-                nonceptr[0] += ((rand()*4) & UINT32_MAX) / opt_n_total_threads;
-        } else
-            ++(*nonceptr);
-        pthread_mutex_unlock(&g_work_lock);
+        regen_work = false;
+
+        /* a restart from now on is for a snapshot past this one */
         work_restart[thr_id].restart = 0;
+        mem_barrier();
+        seen = work_events;
+        snap = work_pickup(thr_id);
+        if (!snap) {
+            work_event_wait(seen, 5);
+            continue;
+        }
+        if (snap != held) {
+            memcpy(&work, &snap->work, sizeof(work));
+            work.N = scrypt_job_n(swab32(work.data[17]));
+            job = snap->job;
+            held = snap;
+            /* an own header and the shared one can carry the same gen */
+            chunk_left = 0;
+            ahead_left = 0;
+            own = work_roll_header(&work, snap, thr_id, &roll);
+            if (own)
+                nonce_job_own(&job, &own_nonces, lanes);
+        }
 
         // prevent scans before a job is received
         // beware, some testnet (decred) are using version 0
         if (have_stratum && !work.data[0] && !opt_benchmark) {
-            sleep(1);
+            work_event_wait(seen, 5);
             continue;
         }
 
-        /* conditional mining */
+        /* conditional mining, new work may bring another diff */
         if (!wanna_mine(thr_id)) {
-            sleep(5);
+            work_event_wait(seen, 5);
             continue;
         }
 
+        /* the first job with another N grows the scratchpad if it has to */
+        if (work.N != scratch_n) {
+            unsigned char *prev = scratchbuf;
+
+            if (thr_id == 0)
+                applog(LOG_NOTICE, "Job N changed from %u to %u", scratch_n, work.N);
+            scratchbuf = scrypt_buffer_resize(scratchbuf, work.N, mythr->forceThroughput);
+            if (!scratchbuf) {
+                applog(LOG_ERR, "scrypt buffer allocation failed");
+                pthread_mutex_lock(&applog_lock);
+                exit(1);
+            }
+            /* ROMix time goes with N, keeps the first scan to the scantime */
+            pthread_mutex_lock(&stats_lock);
+            thr_hashrates[thr_id] *= (double) scratch_n / work.N;
+            pthread_mutex_unlock(&stats_lock);
+            scratch_n = work.N;
+            if (scratchbuf != prev) {
+                mythr->cpu.pages = scrypt_buffer_pages(scratchbuf);
+                mythr->cpu.numa_local = scrypt_buffer_numa(scratchbuf, &mythr->cpu.numa_node);
+                applog(LOG_INFO, "Thread %d: scratchpad resized for N = %u, on %s pages",
+                    thr_id, scratch_n, mythr->cpu.pages);
+            }
+        }
+
         /* adjust max_nonce to meet target scan time */
         if (have_stratum)
             max64 = LP_SCANTIME;
@@ -1768,29 +2700,105 @@ static void *miner_thread(void *userdata)
 
         max64 *= (int64_t) thr_hashrates[thr_id];
 
-        if (max64 <= 0) {
-            max64 = opt_scrypt_n < 16 ? 0x3ffff : 0x3fffff / opt_scrypt_n;
-                if (opt_nfactor > 3)
-                    max64 >>= (opt_nfactor - 3);
-                else if (opt_nfactor > 16)
-                    max64 = 0xF;
+        if (max64 <= 0)
+            max64 = (work.N < 16 ? 0x3ffff : 0x3fffff / work.N) >> 3;
+
+        /* what is left of the chunk, else the one claimed ahead, else the next one */
+        if (chunk_gen != job.gen || !chunk_left) {
+            if (ahead_left && ahead_gen == job.gen) {
+                next_nonce = ahead_first;
+                chunk_left = ahead_left;
+            } else {
+                chunk_left = nonce_claim(&job, (uint64_t) max64, lanes,
+                    own ? 1 : opt_n_total_threads, &next_nonce);
+                if (!chunk_left && own && work_roll_header(&work, held, thr_id, &roll)) {
+                    nonce_job_own(&job, &own_nonces, lanes);
+                    chunk_left = nonce_claim(&job, (uint64_t) max64, lanes, 1, &next_nonce);
+                }
+            }
+            ahead_left = 0;
+            chunk_gen = job.gen;
+            if (!chunk_left) {
+                regen_work = true;
+                continue;
+            }
+        }
+        /*
+         * A pipelined kernel hashes the first loop of the batch after the
+         * scan during it. Before the scan that ends the chunk, claim the
+         * next one: run on into it if it follows on, else have the kernel
+         * start on it, so no batch in flight is thrown away.
+         */
+        if (pipelined && !ahead_left && (uint64_t) chunk_left <= (uint64_t) max64 + lanes) {
+            ahead_left = nonce_claim(&job, (uint64_t) max64, lanes,
+                own ? 1 : opt_n_total_threads, &ahead_first);
+            ahead_gen = job.gen;
+            /* scanhash counts up, no chunk across the wrap */
+            if (ahead_left && ahead_first == next_nonce + chunk_left && ahead_first > next_nonce) {
+                chunk_left += ahead_left;
+                ahead_left = 0;
+            }
         }
-        if ((*nonceptr) + max64 > end_nonce)
-            max_nonce = end_nonce;
+        *nonceptr = next_nonce;
+        /* whole batches, only the chunk's end may cut one */
+        if ((uint64_t) chunk_left > (uint64_t) max64 + lanes)
+            max_nonce = next_nonce + (uint32_t) ((max64 + lanes - 1) / lanes * lanes) - 1;
         else
-            max_nonce = (*nonceptr) + (uint32_t) max64;
+            max_nonce = next_nonce + chunk_left - 1;
+        work.next_nonce = max_nonce + 1;
+        if (ahead_left && max_nonce == next_nonce + chunk_left - 1)
+            work.next_nonce = ahead_first;
 
         hashes_done = 0;
         gettimeofday((struct timeval *) &tv_start, NULL);
 
         if (firstwork_time == 0)
             firstwork_time = time(NULL);
+        if (!time_to_first_hash) {
+            pthread_mutex_lock(&stats_lock);
+            if (!first_work_secs) {
+                timeval_subtract(&diff, &tv_start, &miner_start);
+                first_work_secs = diff.tv_sec + diff.tv_usec * 1e-6;
+            }
+            pthread_mutex_unlock(&stats_lock);
+        }
 
         /* scan nonces for a proof-of-work hash */
-        rc = scanhash_scrypt(thr_id, &work, max_nonce, &hashes_done, scratchbuf, opt_scrypt_n, mythr->forceThroughput);
+        rc = scanhash_scrypt(thr_id, &work, max_nonce, &hashes_done, scratchbuf, work.N, mythr->forceThroughput);
+        next_nonce += (uint32_t) hashes_done;
+        chunk_left -= (uint32_t) hashes_done;
+        if (pipelined) {
+            uint32_t dropped = scrypt_pipe_dropped(scratchbuf);
+            if (dropped) {
+                pthread_mutex_lock(&stats_lock);
+                pipe_dropped += dropped;
+                pthread_mutex_unlock(&stats_lock);
+            }
+        }
+        /* hugetlb pages are there at once, the others only once touched */
+        if (mythr->cpu.numa_node >= 0 && mythr->cpu.numa_local < 0) {
+            mythr->cpu.numa_local = scrypt_buffer_numa(scratchbuf, &mythr->cpu.numa_node);
+            if (mythr->cpu.numa_local >= 0)
+                applog(LOG_INFO, "Thread %d: scratchpad on %s pages, node %d, %d%% local", thr_id,
+                    mythr->cpu.pages, mythr->cpu.numa_node, mythr->cpu.numa_local);
+        }
 
         /* record scanhash elapsed time */
         gettimeofday(&tv_end, NULL);
+        if (work_restart[thr_id].restart) {
+            /* how long the stale batch kept the thread after the restart */
+            struct timeval since;
+            double ms;
+            pthread_mutex_lock(&stats_lock);
+            since = restart_time;
+            timeval_subtract(&diff, &tv_end, &since);
+            ms = diff.tv_sec * 1e3 + diff.tv_usec * 1e-3;
+            if (ms > job_switch_ms)
+                job_switch_ms = ms;
+            pthread_mutex_unlock(&stats_lock);
+            if (opt_debug)
+                applog(LOG_DEBUG, "Thread %d: stale work dropped %.1f ms after the restart", thr_id, ms);
+        }
         timeval_subtract(&diff, &tv_end, &tv_start);
         if (diff.tv_usec || diff.tv_sec) {
             pthread_mutex_lock(&stats_lock);
@@ -1798,6 +2806,16 @@ static void *miner_thread(void *userdata)
                 hashes_done / (diff.tv_sec + diff.tv_usec * 1e-6);
             pthread_mutex_unlock(&stats_lock);
         }
+        if (!time_to_first_hash && hashes_done) {
+            pthread_mutex_lock(&stats_lock);
+            if (!time_to_first_hash) {
+                timeval_subtract(&diff, &tv_end, &miner_start);
+                time_to_first_hash = diff.tv_sec + diff.tv_usec * 1e-6;
+                applog(LOG_INFO, "Time to first hash: %.2fs (work received after %.2fs)",
+                    time_to_first_hash, first_work_secs);
+            }
+            pthread_mutex_unlock(&stats_lock);
+        }
         if (thr_id == opt_n_total_threads - 1 && (unsigned long)time(NULL) > hash_time) {
             hash_time = (unsigned long)time(NULL) + (unsigned long)opt_hash_time_delay;
             double hashrate = 0.;
@@ -1812,7 +2830,18 @@ static void *miner_thread(void *userdata)
 
         /* if nonce found, submit work */
         if (rc && !opt_benchmark) {
-            if (!submit_work(mythr, &work))
+            uint32_t batch_end = *nonceptr;
+            /* a solo block can only be won once */
+            int count = (have_stratum || have_longpoll) ? work.valid_nonces : 1;
+            bool sent = true;
+
+            for (i = 0; i < count && sent; i++) {
+                *nonceptr = work.nonces[i];
+                work.sharediff = work.sharediffs[i];
+                sent = submit_work(mythr, &work);
+            }
+            *nonceptr = batch_end;
+            if (!sent)
                 break;
             // prevent stale work in solo
             // we can't submit twice a block!
@@ -1828,6 +2857,8 @@ static void *miner_thread(void *userdata)
     }
 
 out:
+    work_restart[thr_id].work = NULL;
+    free(roll.coinbase);
     tq_freeze(mythr->q);
 
     return NULL;
@@ -1837,8 +2868,14 @@ void restart_threads(void)
 {
     int i;
 
+    pthread_mutex_lock(&stats_lock);
+    gettimeofday(&restart_time, NULL);
+    job_switch_ms = 0.;
+    pthread_mutex_unlock(&stats_lock);
+    /* the threads poll their flag between ROMix chunks and drop the batch */
     for (i = 0; i < opt_n_total_threads; i++)
         work_restart[i].restart = 1;
+    work_event_signal();
 }
 
 static void *longpoll_thread(void *userdata)
@@ -1930,6 +2967,7 @@ start:
                 rc = work_decode(res, &g_work);
             if (rc) {
                 bool newblock = g_work.job_id && strcmp(start_job_id, g_work.job_id);
+                work_publish();
                 newblock |= (start_diff != net_diff); // the best is the height but... longpoll...
                 if (newblock) {
                     start_diff = net_diff;
@@ -2085,6 +3123,7 @@ static void *stratum_thread(void *userdata)
             pthread_mutex_lock(&g_work_lock);
             stratum_gen_work(&stratum, &g_work);
             time(&g_work_time);
+            work_publish();
             pthread_mutex_unlock(&g_work_lock);
 
             if (stratum.job.clean || jsonrpc_2) {
@@ -2170,6 +3209,9 @@ static void show_version_and_exit(void)
 #if defined(__x86_64__) && defined(USE_AVX2)
         " AVX2"
 #endif
+#if defined(__x86_64__) && defined(USE_AVX512)
+        " AVX512"
+#endif
 #if defined(USE_ASM) && defined(__arm__) && defined(__APCS_32__)
         " ARM"
 #if defined(__ARM_ARCH_5E__) || defined(__ARM_ARCH_5TE__) || \
@@ -2251,6 +3293,10 @@ void parse_arg(int key, char *arg)
         opt_api_remote = 1;
         break;
     case 'n':
+        v = atoi(arg);
+        if (v < 0 || v > NFACTOR_MAX)
+            show_usage_and_exit(1);
+        opt_nfactor = v;
         break;
     case 'B':
         opt_background = true;
@@ -2588,6 +3634,46 @@ void parse_arg(int key, char *arg)
     case 2000: // "ryzen"
         opt_ryzen_1x = true;
         break;
+    case 2001: // "no-avx512"
+        opt_no_avx512 = true;
+        break;
+    case 2002: // "kernel"
+        free(opt_kernel);
+        opt_kernel = strdup(arg);
+        break;
+    case 2003: // "autotune"
+        opt_autotune = true;
+        break;
+    case 2004: // "autotune-file"
+        free(opt_autotune_file);
+        opt_autotune_file = strdup(arg);
+        opt_autotune = true;
+        break;
+    case 2005: // "prefetch"
+        if (!scrypt_set_prefetch(arg))
+            show_usage_and_exit(1);
+        free(opt_prefetch);
+        opt_prefetch = strdup(arg);
+        break;
+    case 2006: // "tmto"
+        v = atoi(arg);
+        if (!scrypt_set_tmto(v))
+            show_usage_and_exit(1);
+        opt_tmto = v;
+        break;
+    case 2007: // "no-numa"
+        opt_no_numa = true;
+        break;
+    case 2008: // "layout"
+        if (!scrypt_set_layout(arg))
+            show_usage_and_exit(1);
+        free(opt_layout);
+        opt_layout = strdup(arg);
+        break;
+    case 2009: // "nfactor-schedule"
+        if (!parse_nfactor_schedule(arg))
+            show_usage_and_exit(1);
+        break;
     case 'V':
         show_version_and_exit();
     case 'h':
@@ -2717,6 +3803,7 @@ int main(int argc, char *argv[]) {
     int i, err;
 
     pthread_mutex_init(&applog_lock, NULL);
+    gettimeofday(&miner_start, NULL);
 
     show_credits();
 
@@ -2756,6 +3843,7 @@ int main(int argc, char *argv[]) {
     }
 
     opt_n_total_threads = opt_n_default_threads + opt_n_oneway_threads;
+    bool threads_set = opt_n_total_threads > 0;
 
     if (!opt_n_total_threads)
     {
@@ -2773,6 +3861,39 @@ int main(int argc, char *argv[]) {
         show_usage_and_exit(1);
     }
 
+    /* scratchpads are sized for today's jobs, later ones resize them */
+    opt_scrypt_n = scrypt_job_n((uint32_t) time(NULL));
+
+    if (opt_tmto && !opt_kernel)
+        opt_kernel = strdup("tmto");
+    if (!scrypt_set_kernel(opt_kernel))
+        return 1;
+    if (opt_autotune)
+        scrypt_autotune(opt_scrypt_n, opt_kernel, opt_prefetch, opt_layout, opt_tmto,
+                        opt_autotune_file, !threads_set);
+#ifdef __linux__
+    if (numa_node_count() > 1)
+        applog(LOG_INFO, "NUMA: %d nodes, threads %s", numa_node_count(),
+            use_affinity_mask != 0 ? "bound by --cpu-affinity" :
+            opt_no_numa ? "not bound" : "spread over the nodes");
+#endif
+    applog(LOG_INFO, "Using scrypt kernel %s, prefetch %s", scrypt_kernel_name(-1),
+           scrypt_prefetch_name(-1));
+    if (scrypt_layout_tunable())
+        applog(LOG_INFO, "Scratchpad layout %s", scrypt_layout_name(-1));
+    else if (opt_layout)
+        applog(LOG_WARNING, "The %s kernel has a fixed scratchpad layout, --layout ignored",
+               scrypt_kernel_name(-1));
+    if (!strcmp(scrypt_kernel_name(-1), "tmto"))
+        applog(LOG_INFO, "TMTO keeps 1 scratchpad block in %d, %d MiB per thread",
+               scrypt_get_tmto(), (int) (((uint64_t) opt_scrypt_n * 128 / scrypt_get_tmto()) >> 20));
+    if (opt_n_oneway_threads)
+        applog(LOG_INFO, "Oneway threads use scrypt kernel %s", scrypt_kernel_name(1));
+    if (opt_benchmark) {
+        scrypt_prefetch_report(opt_scrypt_n);
+        scrypt_layout_report(opt_scrypt_n);
+    }
+
     if (!rpc_userpass) {
         rpc_userpass = (char*) malloc(strlen(rpc_user) + strlen(rpc_pass) + 2);
         if (!rpc_userpass)
@@ -2782,6 +3903,8 @@ int main(int argc, char *argv[]) {
 
     pthread_mutex_init(&stats_lock, NULL);
     pthread_mutex_init(&g_work_lock, NULL);
+    pthread_mutex_init(&work_event_lock, NULL);
+    pthread_cond_init(&work_event_cond, NULL);
     pthread_mutex_init(&rpc2_job_lock, NULL);
     pthread_mutex_init(&rpc2_login_lock, NULL);
     pthread_mutex_init(&stratum.sock_lock, NULL);
@@ -2876,6 +3999,28 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    /*
+     * All the scratchpads at once, faulted in by helper threads while the
+     * pool connection below is set up.
+     */
+    {
+        int *throughput = (int*) calloc(opt_n_total_threads, sizeof(int));
+        int *node = (int*) calloc(opt_n_total_threads, sizeof(int));
+        if (!throughput || !node)
+            return 1;
+        for (i = 0; i < opt_n_total_threads; i++) {
+            throughput[i] = i >= opt_n_default_threads ? 1 : -1;
+            node[i] = thread_numa_node(i);
+        }
+        if (!scrypt_arena_reserve(opt_scrypt_n, opt_n_total_threads, throughput, node)) {
+            applog(LOG_ERR, "scrypt buffer allocation failed");
+            return 1;
+        }
+        free(throughput);
+        free(node);
+        scrypt_arena_prefault();
+    }
+
     work_restart = (struct work_restart*) calloc(opt_n_total_threads, sizeof(*work_restart));
     if (!work_restart)
         return 1;
@@ -199,7 +199,38 @@ void sha256_transform_8way(uint32_t *state, const uint32_t *block, int swap);
 struct work;
 
 int scanhash_sha256d(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *hashes_done);
+bool scrypt_set_kernel(const char *name);
+const char *scrypt_kernel_name(int forceThroughput);
+bool scrypt_set_lanes(int lanes);
+int scrypt_get_lanes(void);
+bool scrypt_set_tmto(int ratio);
+int scrypt_get_tmto(void);
+bool scrypt_set_prefetch(const char *name);
+const char *scrypt_prefetch_name(int i);
+bool scrypt_prefetch_tunable(void);
+bool scrypt_pipelined(int forceThroughput);
+uint32_t scrypt_pipe_dropped(unsigned char *scratchbuf);
+bool scrypt_set_layout(const char *name);
+const char *scrypt_layout_name(int i);
+bool scrypt_layout_tunable(void);
+double scrypt_core_time(unsigned char *scratchbuf, int N, int i, int calls);
+int scrypt_kernel_count(void);
+const char *scrypt_kernel_info(int i, int *ways);
 unsigned char *scrypt_buffer_alloc(int N, int forceThroughput);
+void scrypt_buffer_free(unsigned char *scratchbuf);
+unsigned char *scrypt_buffer_resize(unsigned char *scratchbuf, int N, int forceThroughput);
+const char *scrypt_buffer_pages(const unsigned char *scratchbuf);
+void scrypt_pages_report(char *buf, size_t len);
+int scrypt_buffer_numa(const unsigned char *scratchbuf, int *node);
+bool scrypt_arena_reserve(int N, int threads, const int *forceThroughput, const int *node);
+bool scrypt_arena_release(void);
+void scrypt_arena_prefault(void);
+unsigned char *scrypt_arena_slice(int thr_id);
+void scrypt_arena_report(char *buf, size_t len);
+bool scrypt_autotune(int N, const char *kernel, const char *prefetch, const char *layout,
+	int tmto, const char *profile_file, bool tune_threads);
+void scrypt_prefetch_report(int N);
+void scrypt_layout_report(int N);
 int scanhash_scrypt(int thr_id, struct work *work, uint32_t max_nonce, uint64_t *hashes_done,
 					unsigned char *scratchbuf, uint32_t N, int forceThroughput);
 
@@ -215,6 +246,9 @@ struct cpu_info {
 	float cpu_temp;
 	int cpu_fan;
 	uint32_t cpu_clock;
+	const char *pages;
+	int numa_node;	/* -1 without NUMA */
+	int numa_local;	/* % of the scratchpad on numa_node, -1 unknown */
 };
 
 struct thr_api {
@@ -234,8 +268,9 @@ struct thr_info {
 };
 
 struct work_restart {
+	const void * volatile work;	/* the work snapshot the thread holds */
 	volatile uint8_t restart;
-	char padding[128 - sizeof(uint8_t)];
+	char padding[128 - sizeof(void *) - sizeof(uint8_t)];
 };
 
 extern bool opt_debug;
@@ -257,6 +292,7 @@ extern char *opt_cert;
 extern char *opt_proxy;
 extern long opt_proxy_type;
 extern bool opt_ryzen_1x;
+extern bool opt_no_avx512;
 extern bool use_syslog;
 extern bool use_colors;
 extern pthread_mutex_t applog_lock;
@@ -264,6 +300,8 @@ extern struct thr_info *thr_info;
 extern int longpoll_thr_id;
 extern int stratum_thr_id;
 extern int api_thr_id;
+extern int opt_n_default_threads;
+extern int opt_n_oneway_threads;
 extern int opt_n_total_threads;
 extern int num_cpus;
 extern struct work_restart *work_restart;
@@ -315,6 +353,18 @@ void applog(int prio, const char *fmt, ...);
 void restart_threads(void);
 extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
 	const char *rpc_req, int *curl_err, int flags);
+struct json_rpc_req;
+struct json_rpc_req *json_rpc_begin(CURL *curl, const char *url, const char *userpass,
+	const char *rpc_req, int flags, long timeout);
+json_t *json_rpc_end(struct json_rpc_req *req, int rc, int *curl_err);
+
+/* latency of the HTTP requests the workio thread runs side by side */
+struct rpc_stats {
+	uint32_t count;
+	uint32_t failed;
+	double total_ms;
+	double max_ms;
+};
 void bin2hex(char *s, const unsigned char *p, size_t len);
 char *abin2hex(const unsigned char *p, size_t len);
 bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
@@ -331,10 +381,24 @@ void work_set_target_ratio(struct work* work, uint32_t* hash);
 
 void get_currentalgo(char* buf, int sz);
 bool has_aes_ni(void);
+bool has_avx(void);
+bool has_xop(void);
+bool has_avx2(void);
+bool has_avx512(void);
+bool cpu_is_intel(void);
+bool cpu_has_slow_simd(void);
+bool cpu_has_wide_neon(void);
+int numa_node_count(void);
+int numa_node_of_cpu(int cpu);
+int numa_thread_node(void);
 void cpu_bestfeature(char *outbuf, size_t maxsz);
 void cpu_getname(char *outbuf, size_t maxsz);
 void cpu_getmodelid(char *outbuf, size_t maxsz);
 float cpu_temp(int core);
+uint64_t sys_memory_size(void);
+
+/* most nonces a scanhash batch can win, one per lane */
+#define WORK_MAX_NONCES 32
 
 struct work {
 	uint32_t data[48];
@@ -344,6 +408,8 @@ struct work {
 	double shareratio;
 	double sharediff;
 	uint32_t resnonce;
+	uint32_t N;	/* scrypt N of the job */
+	uint32_t next_nonce;	/* where the scan after this one starts, see scanhash_scrypt() */
 
 	int height;
 	char *txs;
@@ -352,6 +418,11 @@ struct work {
 	char *job_id;
 	size_t xnonce2_len;
 	unsigned char *xnonce2;
+
+	/* the winning nonces of the last batch, and their share diffs */
+	int valid_nonces;
+	uint32_t nonces[WORK_MAX_NONCES];
+	double sharediffs[WORK_MAX_NONCES];
 };
 
 struct stratum_job {
@@ -0,0 +1,384 @@
+/*
+ * Lane-generic scrypt ROMix kernels
+ *
+ * One template, instantiated for each lane count the hand-written
+ * kernels do not cover. The lanes are kept word-interleaved (B[word][lane])
+ * so every Salsa20/8 step is a loop over the lanes, which the compiler
+ * unrolls and vectorizes for whatever SIMD width the target has.
+ *
+ * Unlike the asm kernels, these take their V layout at run time from
+ * scrypt_v_layout (see scrypt_set_layout()).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+extern "C" {
+/* 2 * layout + nt, with layout one of the enum below; set by scrypt.c */
+int scrypt_v_layout = 0;
+}
+
+namespace {
+
+enum {
+	LAYOUT_INTERLEAVE,	/* block i of lane l at (i * L + l) * 32 */
+	LAYOUT_STAGGER,		/* lane l contiguous, l * lane_pad words further */
+	LAYOUT_CONTIG		/* lane l contiguous at l * N * 32 */
+};
+
+/*
+ * Stagger: a page and a block per lane, so the lanes writing block i at
+ * the same time in the first loop neither alias at the same 4 KiB offset
+ * nor keep landing in the same DRAM bank.
+ */
+const size_t lane_pad = (4096 + 128) / 4;
+
+template <int L>
+struct vlayout {
+	size_t lane[L];		/* words to block 0 of each lane */
+	size_t stride;		/* words from one block of a lane to the next */
+	bool nt;		/* first loop stores bypass the caches */
+
+	explicit vlayout(int N)
+	{
+		int layout = scrypt_v_layout >> 1;
+
+		nt = scrypt_v_layout & 1;
+		stride = layout == LAYOUT_INTERLEAVE ? L * 32 : 32;
+		for (int l = 0; l < L; l++) {
+			if (layout == LAYOUT_INTERLEAVE)
+				lane[l] = (size_t) l * 32;
+			else if (layout == LAYOUT_STAGGER)
+				lane[l] = (size_t) l * ((size_t) N * 32 + lane_pad);
+			else
+				lane[l] = (size_t) l * N * 32;
+		}
+	}
+
+	uint32_t *block(uint32_t *V, size_t i, int l) const
+	{
+		return V + lane[l] + i * stride;
+	}
+};
+
+/* one 128-byte block to V, around the caches if nt */
+inline void store_block(uint32_t *v, const uint32_t *b, bool nt)
+{
+#if defined(__SSE2__)
+	if (nt) {
+		for (int k = 0; k < 8; k++)
+			_mm_stream_si128((__m128i *) v + k, _mm_loadu_si128((const __m128i *) b + k));
+		return;
+	}
+#elif defined(__aarch64__) && defined(__GNUC__)
+	if (nt) {
+		for (int k = 0; k < 32; k += 8)
+			__asm__ volatile("stnp %q0, %q1, [%2]" : : "w"(vld1q_u32(b + k)),
+				"w"(vld1q_u32(b + k + 4)), "r"(v + k) : "memory");
+		return;
+	}
+#endif
+	memcpy(v, b, 128);
+}
+
+/* orders the streamed blocks before the second loop reads them */
+inline void store_fence(bool nt)
+{
+#if defined(__SSE2__)
+	if (nt)
+		_mm_sfence();
+#elif defined(__aarch64__) && defined(__GNUC__)
+	if (nt)
+		__asm__ volatile("dmb ishst" : : : "memory");
+#endif
+}
+
+inline uint32_t rotl(uint32_t a, int b)
+{
+	return (a << b) | (a >> (32 - b));
+}
+
+/* x[d] ^= R(x[a] + x[b], r) on every lane */
+template <int L>
+inline void step(uint32_t (*x)[L], int d, int a, int b, int r)
+{
+	for (int l = 0; l < L; l++)
+		x[d][l] ^= rotl(x[a][l] + x[b][l], r);
+}
+
+template <int L>
+inline void xor_salsa8(uint32_t (*B)[L], const uint32_t (*Bx)[L])
+{
+	uint32_t x[16][L];
+	int i, w, l;
+
+	for (w = 0; w < 16; w++)
+		for (l = 0; l < L; l++)
+			x[w][l] = (B[w][l] ^= Bx[w][l]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		step<L>(x,  4,  0, 12,  7);	step<L>(x,  9,  5,  1,  7);
+		step<L>(x, 14, 10,  6,  7);	step<L>(x,  3, 15, 11,  7);
+
+		step<L>(x,  8,  4,  0,  9);	step<L>(x, 13,  9,  5,  9);
+		step<L>(x,  2, 14, 10,  9);	step<L>(x,  7,  3, 15,  9);
+
+		step<L>(x, 12,  8,  4, 13);	step<L>(x,  1, 13,  9, 13);
+		step<L>(x,  6,  2, 14, 13);	step<L>(x, 11,  7,  3, 13);
+
+		step<L>(x,  0, 12,  8, 18);	step<L>(x,  5,  1, 13, 18);
+		step<L>(x, 10,  6,  2, 18);	step<L>(x, 15, 11,  7, 18);
+
+		/* Operate on rows. */
+		step<L>(x,  1,  0,  3,  7);	step<L>(x,  6,  5,  4,  7);
+		step<L>(x, 11, 10,  9,  7);	step<L>(x, 12, 15, 14,  7);
+
+		step<L>(x,  2,  1,  0,  9);	step<L>(x,  7,  6,  5,  9);
+		step<L>(x,  8, 11, 10,  9);	step<L>(x, 13, 12, 15,  9);
+
+		step<L>(x,  3,  2,  1, 13);	step<L>(x,  4,  7,  6, 13);
+		step<L>(x,  9,  8, 11, 13);	step<L>(x, 14, 13, 12, 13);
+
+		step<L>(x,  0,  3,  2, 18);	step<L>(x,  5,  4,  7, 18);
+		step<L>(x, 10,  9,  8, 18);	step<L>(x, 15, 14, 13, 18);
+	}
+	for (w = 0; w < 16; w++)
+		for (l = 0; l < L; l++)
+			B[w][l] += x[w][l];
+}
+
+/*
+ * Same interface as the asm kernels: X holds L consecutive 32-word
+ * states, and a call runs ROMix iterations from to to - 1, all in the
+ * first loop or all in the second. Every lane's block is one 128-byte
+ * run in V, wherever the layout puts it.
+ */
+template <int L>
+void scrypt_core_lanes(uint32_t *X, uint32_t *V, int N, int from, int to)
+{
+	const vlayout<L> lay(N);
+	uint32_t B[32][L], T[32];
+	uint32_t *v;
+	int i, w, l;
+
+	for (l = 0; l < L; l++)
+		for (w = 0; w < 32; w++)
+			B[w][l] = X[l * 32 + w];
+
+	if (from < N) {
+		for (i = from; i < to; i++) {
+			for (l = 0; l < L; l++) {
+				v = lay.block(V, i, l);
+				if (lay.nt) {
+					for (w = 0; w < 32; w++)
+						T[w] = B[w][l];
+					store_block(v, T, true);
+				} else {
+					for (w = 0; w < 32; w++)
+						v[w] = B[w][l];
+				}
+			}
+			xor_salsa8<L>(B, B + 16);
+			xor_salsa8<L>(B + 16, B);
+		}
+		store_fence(lay.nt);
+	} else {
+		for (i = from; i < to; i++) {
+			for (l = 0; l < L; l++) {
+				v = lay.block(V, B[16][l] & (N - 1), l);
+				for (w = 0; w < 32; w++)
+					B[w][l] ^= v[w];
+			}
+			xor_salsa8<L>(B, B + 16);
+			xor_salsa8<L>(B + 16, B);
+		}
+	}
+
+	for (l = 0; l < L; l++)
+		for (w = 0; w < 32; w++)
+			X[l * 32 + w] = B[w][l];
+}
+
+#if defined(__aarch64__)
+
+/*
+ * NEON kernels. Each lane keeps its two Salsa20 blocks as four rows in
+ * the diagonal order of scrypt_core_3way (see scrypt_shuffle), so the
+ * column and row rounds are whole-vector operations, and the lanes are
+ * interleaved to cover the latency of each step. V takes the same
+ * layouts as above. PF is the prefetch hint (t0, nta, off): once a lane's
+ * next block index is known, its 128 bytes are prefetched before the
+ * rest of the state is finished, as scrypt-arm.S does.
+ */
+
+const int neon_order[16] = { 0, 5, 10, 15, 12, 1, 6, 11, 8, 13, 2, 7, 4, 9, 14, 3 };
+
+template <int PF>
+inline void neon_prefetch(const uint32_t *p)
+{
+	if (PF == 0)
+		__builtin_prefetch(p, 0, 3);
+	else if (PF == 1)
+		__builtin_prefetch(p, 0, 0);
+}
+
+/* x[d] ^= R(x[a] + x[b], r) on every lane */
+template <int L, int R>
+inline void neon_step(uint32x4_t (*x)[4], int d, int a, int b)
+{
+	for (int l = 0; l < L; l++) {
+		uint32x4_t t = vaddq_u32(x[l][a], x[l][b]);
+		x[l][d] = veorq_u32(x[l][d], vsriq_n_u32(vshlq_n_u32(t, R), t, 32 - R));
+	}
+}
+
+/* rotate row d of every lane by n words */
+template <int L, int n>
+inline void neon_rot(uint32x4_t (*x)[4], int d)
+{
+	for (int l = 0; l < L; l++)
+		x[l][d] = vextq_u32(x[l][d], x[l][d], n);
+}
+
+/*
+ * B[l][b..b+3] = Salsa20/8(B[l][b..b+3] ^ B[l][bx..bx+3]). With PF < 2
+ * the block each lane reads next from V is prefetched.
+ */
+template <int L, int b, int bx, int PF>
+inline void neon_salsa8(uint32x4_t (*B)[8], uint32_t *V, int N, const vlayout<L> &lay)
+{
+	uint32x4_t x[L][4];
+	int i, k, l;
+
+	for (l = 0; l < L; l++)
+		for (k = 0; k < 4; k++)
+			x[l][k] = B[l][b + k] = veorq_u32(B[l][b + k], B[l][bx + k]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		neon_step<L,  7>(x, 3, 0, 1);
+		neon_step<L,  9>(x, 2, 3, 0);
+		neon_step<L, 13>(x, 1, 2, 3);
+		neon_step<L, 18>(x, 0, 1, 2);
+		neon_rot<L, 3>(x, 3);
+		neon_rot<L, 2>(x, 2);
+		neon_rot<L, 1>(x, 1);
+
+		/* Operate on rows. */
+		neon_step<L,  7>(x, 1, 0, 3);
+		neon_step<L,  9>(x, 2, 1, 0);
+		neon_step<L, 13>(x, 3, 2, 1);
+		neon_step<L, 18>(x, 0, 3, 2);
+		neon_rot<L, 3>(x, 1);
+		neon_rot<L, 2>(x, 2);
+		neon_rot<L, 1>(x, 3);
+	}
+	for (l = 0; l < L; l++)
+		B[l][b] = vaddq_u32(B[l][b], x[l][0]);
+	if (PF < 2) {
+		for (l = 0; l < L; l++) {
+			const uint32_t *v = lay.block(V, vgetq_lane_u32(B[l][b], 0) & (N - 1), l);
+			neon_prefetch<PF>(v);
+			neon_prefetch<PF>(v + 16);
+		}
+	}
+	for (l = 0; l < L; l++)
+		for (k = 1; k < 4; k++)
+			B[l][b + k] = vaddq_u32(B[l][b + k], x[l][k]);
+}
+
+template <int L, int PF>
+void scrypt_core_neon(uint32_t *X, uint32_t *V, int N, int from, int to)
+{
+	const vlayout<L> lay(N);
+	uint32x4_t B[L][8];
+	uint32_t T[32], *v;
+	int i, w, k, l;
+
+	for (l = 0; l < L; l++) {
+		for (w = 0; w < 32; w++)
+			T[w] = X[l * 32 + (w & 16) + neon_order[w & 15]];
+		for (k = 0; k < 8; k++)
+			B[l][k] = vld1q_u32(T + k * 4);
+	}
+
+	if (from < N) {
+		for (i = from; i < to; i++) {
+			for (l = 0; l < L; l++) {
+				v = lay.block(V, i, l);
+				if (lay.nt) {
+					for (k = 0; k < 8; k++)
+						vst1q_u32(T + k * 4, B[l][k]);
+					store_block(v, T, true);
+				} else {
+					for (k = 0; k < 8; k++)
+						vst1q_u32(v + k * 4, B[l][k]);
+				}
+			}
+			neon_salsa8<L, 0, 4, 2>(B, V, N, lay);
+			neon_salsa8<L, 4, 0, 2>(B, V, N, lay);
+		}
+		store_fence(lay.nt);
+	} else {
+		for (i = from; i < to; i++) {
+			for (l = 0; l < L; l++) {
+				v = lay.block(V, vgetq_lane_u32(B[l][4], 0) & (N - 1), l);
+				for (k = 0; k < 8; k++)
+					B[l][k] = veorq_u32(B[l][k], vld1q_u32(v + k * 4));
+			}
+			neon_salsa8<L, 0, 4, 2>(B, V, N, lay);
+			neon_salsa8<L, 4, 0, PF>(B, V, N, lay);
+		}
+	}
+
+	for (l = 0; l < L; l++) {
+		for (k = 0; k < 8; k++)
+			vst1q_u32(T + k * 4, B[l][k]);
+		for (w = 0; w < 32; w++)
+			X[l * 32 + (w & 16) + neon_order[w & 15]] = T[w];
+	}
+}
+
+#endif
+
+}
+
+extern "C" {
+
+/* bytes of V the kernels here need for L lanes with the current layout */
+size_t scrypt_layout_bytes(int L, int N)
+{
+	if (scrypt_v_layout >> 1 == LAYOUT_STAGGER)
+		return ((size_t) N * 32 + lane_pad) * L * 4;
+	return (size_t) N * 32 * L * 4;
+}
+
+void scrypt_core_2way_c(uint32_t *X, uint32_t *V, int N, int from, int to) { scrypt_core_lanes<2>(X, V, N, from, to); }
+void scrypt_core_4way_c(uint32_t *X, uint32_t *V, int N, int from, int to) { scrypt_core_lanes<4>(X, V, N, from, to); }
+void scrypt_core_6way_c(uint32_t *X, uint32_t *V, int N, int from, int to) { scrypt_core_lanes<6>(X, V, N, from, to); }
+void scrypt_core_8way_c(uint32_t *X, uint32_t *V, int N, int from, int to) { scrypt_core_lanes<8>(X, V, N, from, to); }
+void scrypt_core_16way_c(uint32_t *X, uint32_t *V, int N, int from, int to) { scrypt_core_lanes<16>(X, V, N, from, to); }
+void scrypt_core_32way_c(uint32_t *X, uint32_t *V, int N, int from, int to) { scrypt_core_lanes<32>(X, V, N, from, to); }
+
+#if defined(__aarch64__)
+#define NEON_CORES(L) \
+	void scrypt_core_##L##way_neon(uint32_t *X, uint32_t *V, int N, int from, int to) { scrypt_core_neon<L, 0>(X, V, N, from, to); } \
+	void scrypt_core_##L##way_neon_nta(uint32_t *X, uint32_t *V, int N, int from, int to) { scrypt_core_neon<L, 1>(X, V, N, from, to); } \
+	void scrypt_core_##L##way_neon_nopf(uint32_t *X, uint32_t *V, int N, int from, int to) { scrypt_core_neon<L, 2>(X, V, N, from, to); }
+NEON_CORES(4)
+NEON_CORES(6)
+NEON_CORES(8)
+#endif
+
+}
@@ -4,6 +4,7 @@
  * tpruvot 2014
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
@@ -12,6 +13,8 @@
 #include "miner.h"
 
 #ifndef WIN32
+#include <unistd.h>
+#include <sched.h>
 
 #define HWMON_PATH \
  "/sys/devices/virtual/thermal/thermal_zone3/temp"
@@ -135,6 +138,24 @@ int cpu_fanpercent()
 	return 0;
 }
 
+/* physical memory in bytes, 0 if unknown */
+uint64_t sys_memory_size()
+{
+#ifdef WIN32
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	if (!GlobalMemoryStatusEx(&status))
+		return 0;
+	return (uint64_t) status.ullTotalPhys;
+#else
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pagesize = sysconf(_SC_PAGESIZE);
+	if (pages <= 0 || pagesize <= 0)
+		return 0;
+	return (uint64_t) pages * pagesize;
+#endif
+}
+
 #if !defined(__arm__) && !defined(__aarch64__)
 static inline void cpuid(int functionnumber, int output[4]) {
 #ifdef _MSC_VER
@@ -268,6 +289,11 @@ void cpu_getmodelid(char *outbuf, size_t maxsz)
 #define SSE2_Flag     (1 << 26) // EDX
 
 #define AVX2_Flag     (1 << 5) // ADV EBX
+#define AVX512F_Flag  (1 << 16) // ADV EBX
+
+// OS state (XCR0) needed for each register file
+#define XCR0_YMM      0x06
+#define XCR0_ZMM      0xe6
 
 bool has_aes_ni()
 {
@@ -280,6 +306,235 @@ bool has_aes_ni()
 #endif
 }
 
+#if !defined(__arm__) && !defined(__aarch64__)
+static inline uint32_t xgetbv0(void)
+{
+#ifdef _MSC_VER
+	return (uint32_t) _xgetbv(0);
+#else
+	uint32_t a, d;
+	asm volatile("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+	return a;
+#endif
+}
+#endif
+
+bool has_avx()
+{
+#if defined(__arm__) || defined(__aarch64__)
+	return false;
+#else
+	int cpu_info[4] = { 0 };
+	cpuid(1, cpu_info);
+	if ((cpu_info[2] & AVX1_Flag) != AVX1_Flag)
+		return false;
+	return (xgetbv0() & XCR0_YMM) == XCR0_YMM;
+#endif
+}
+
+bool has_xop()
+{
+#if defined(__arm__) || defined(__aarch64__)
+	return false;
+#else
+	int cpu_info[4] = { 0 };
+	if (!has_avx())
+		return false;
+	cpuid(0x80000001, cpu_info);
+	return cpu_info[2] & XOP_Flag;
+#endif
+}
+
+bool has_avx2()
+{
+#if defined(__arm__) || defined(__aarch64__)
+	return false;
+#else
+	int cpu_info[4] = { 0 };
+	if (!has_avx())
+		return false;
+	cpuid(7, cpu_info);
+	return cpu_info[1] & AVX2_Flag;
+#endif
+}
+
+bool has_avx512()
+{
+#if defined(__arm__) || defined(__aarch64__)
+	return false;
+#else
+	int cpu_info[4] = { 0 };
+	if (!has_avx2())
+		return false;
+	cpuid(7, cpu_info);
+	if (!(cpu_info[1] & AVX512F_Flag))
+		return false;
+	return (xgetbv0() & XCR0_ZMM) == XCR0_ZMM;
+#endif
+}
+
+bool cpu_is_intel()
+{
+#if defined(__arm__) || defined(__aarch64__)
+	return false;
+#else
+	int cpu_info[4] = { 0 };
+	cpuid(0, cpu_info);
+	// "GenuineIntel" in ebx, edx, ecx
+	return cpu_info[1] == 0x756e6547 && cpu_info[3] == 0x49656e69 &&
+		cpu_info[2] == 0x6c65746e;
+#endif
+}
+
+// AMD K8/Bobcat and the in-order Intel Atoms gain nothing from
+// interleaving several SIMD lanes, one lane per thread is faster there
+bool cpu_has_slow_simd()
+{
+#if defined(__arm__) || defined(__aarch64__)
+	return false;
+#else
+	int cpu_info[4] = { 0 };
+	int sig;
+	cpuid(0, cpu_info);
+	bool amd = cpu_info[1] == 0x68747541 && cpu_info[3] == 0x69746e65 &&
+		cpu_info[2] == 0x444d4163; // "AuthenticAMD"
+	bool intel = cpu_is_intel();
+	cpuid(1, cpu_info);
+	sig = cpu_info[0];
+	if (amd) {
+		// extended family 0 (K8) or 5 (Bobcat)
+		int extfam = (sig & 0x0ff00000);
+		return extfam == 0 || extfam == 0x00500000;
+	}
+	if (intel && (sig & 0x0ff00f00) == 0x00000600) {
+		// family 6, models 0x1c, 0x26 and 0x36
+		int model = (sig & 0x000f00f0);
+		return model == 0x000100c0 || model == 0x00020060 || model == 0x00030060;
+	}
+	return false;
+#endif
+}
+
+// NUMA topology from /sys/devices/system/node, read once
+#define NUMA_MAX_CPUS 4096
+static int numa_nodes = -1;
+static signed char numa_cpu_nodes[NUMA_MAX_CPUS];
+
+#ifdef __linux__
+// "0-7,16-23" -> cpus 0 to 7 and 16 to 23 belong to node
+static void numa_parse_cpulist(const char *list, int node)
+{
+	const char *p = list;
+	while (*p && *p != '\n') {
+		char *end;
+		long lo = strtol(p, &end, 10), hi = lo;
+		if (end == p)
+			break;
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		for (long c = lo; c <= hi && c < NUMA_MAX_CPUS; c++)
+			numa_cpu_nodes[c] = node;
+		p = (*end == ',') ? end + 1 : end;
+	}
+}
+#endif
+
+int numa_node_count()
+{
+	if (numa_nodes >= 0)
+		return numa_nodes;
+	memset(numa_cpu_nodes, -1, sizeof(numa_cpu_nodes));
+	numa_nodes = 1;
+#ifdef __linux__
+	for (int node = 0; node < 128; node++) {
+		char path[64], list[4096];
+		FILE *fd;
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		fd = fopen(path, "r");
+		if (!fd)
+			continue;
+		if (fgets(list, sizeof(list), fd)) {
+			numa_parse_cpulist(list, node);
+			if (node + 1 > numa_nodes)
+				numa_nodes = node + 1;
+		}
+		fclose(fd);
+	}
+#endif
+	return numa_nodes;
+}
+
+// node of a cpu, -1 if unknown
+int numa_node_of_cpu(int cpu)
+{
+	numa_node_count();
+	if (cpu < 0 || cpu >= NUMA_MAX_CPUS)
+		return -1;
+	return numa_cpu_nodes[cpu];
+}
+
+// node the calling thread is confined to by its affinity, -1 if several
+int numa_thread_node()
+{
+#ifdef __linux__
+	cpu_set_t set;
+	int node = -1;
+	if (numa_node_count() < 2)
+		return -1;
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return -1;
+	for (int c = 0; c < CPU_SETSIZE && c < NUMA_MAX_CPUS; c++) {
+		if (!CPU_ISSET(c, &set))
+			continue;
+		if (node == -1)
+			node = numa_cpu_nodes[c];
+		else if (numa_cpu_nodes[c] != node)
+			return -1;
+	}
+	return node;
+#else
+	return -1;
+#endif
+}
+
+// aarch64 cores with enough NEON pipes and outstanding misses to keep
+// more than three scrypt lanes busy: Arm Cortex-A76 and later big
+// cores, Neoverse N1/N2/V1/V2, and Ampere's own cores
+bool cpu_has_wide_neon()
+{
+#if defined(__aarch64__) && defined(__linux__)
+	static const int arm_parts[] = {
+		0xd0b, 0xd0c, 0xd0d, 0xd40, 0xd41, 0xd44, 0xd47, 0xd48,
+		0xd49, 0xd4b, 0xd4d, 0xd4e, 0xd4f, 0xd81, 0xd82, 0xd84, 0xd8e
+	};
+	FILE *fd = fopen("/proc/cpuinfo", "rb");
+	char *buf = NULL, *p;
+	size_t size = 0;
+	int implementer = -1, part = -1, i;
+	if (!fd) return false;
+	while(getdelim(&buf, &size, 0, fd) != -1) {
+		if (buf && (p = strstr(buf, "CPU implementer")) && (p = strstr(p, ":")))
+			implementer = strtol(p + 2, NULL, 0);
+		if (buf && (p = strstr(buf, "CPU part")) && (p = strstr(p, ":")))
+			part = strtol(p + 2, NULL, 0);
+		if (implementer != -1 && part != -1)
+			break;
+	}
+	free(buf);
+	fclose(fd);
+	if (implementer == 0xc0) // Ampere
+		return true;
+	if (implementer != 0x41) // ARM
+		return false;
+	for (i = 0; i < sizeof(arm_parts) / sizeof(arm_parts[0]); i++)
+		if (part == arm_parts[i])
+			return true;
+	return false;
+#else
+	return false;
+#endif
+}
+
 void cpu_bestfeature(char *outbuf, size_t maxsz)
 {
 #if defined(__arm__) || defined(__aarch64__)
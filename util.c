@@ -63,15 +63,52 @@ struct header_info {
 	char		*stratum_url;
 };
 
+/*
+ * Thread queues are rings, many producers and one consumer: a producer
+ * takes a position with a compare-and-swap, a slot's sequence tells its
+ * consumer when the data is in. The reason is not speed, nothing here
+ * has been measured to be faster than the old locked list; it is that a
+ * push should not fail for want of memory. A failed submit_work() ends
+ * its miner thread, and the list allocated an entry on every push. The
+ * ring allocates nothing. Past TQ_SIZE entries a push still never
+ * blocks: it goes onto a locked list, allocated as before, and so do all
+ * the pushes after it until the consumer has emptied the list, so the
+ * queue keeps its order and is only bounded by memory, as it always was.
+ * tq_pop() returns NULL only for a NULL push, a timeout or a frozen
+ * queue, never for a spurious wakeup, which the workio thread would take
+ * as its exit command. The mutex and cond are for the list and for the
+ * consumer to sleep on an empty queue.
+ */
+#define TQ_SIZE 256
+
+#ifdef _MSC_VER
+#define tq_cas(p, o, n) (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(n), (LONG)(o)) == (LONG)(o))
+#define tq_barrier() MemoryBarrier()
+#else
+#define tq_cas(p, o, n) __sync_bool_compare_and_swap(p, o, n)
+#define tq_barrier() __sync_synchronize()
+#endif
+
+struct tq_slot {
+	volatile uint32_t	seq;
+	void			*data;
+};
+
 struct tq_ent {
 	void			*data;
 	struct list_head	q_node;
 };
 
 struct thread_q {
-	struct list_head	q;
+	struct tq_slot		slot[TQ_SIZE];
+	volatile uint32_t	head;		/* next position to push */
+	char			pad[64];
+	uint32_t		tail;		/* next position to pop */
 
-	bool frozen;
+	volatile bool frozen;
+	volatile int		sleeping;	/* consumer waiting on cond */
+	volatile int		spilled;	/* entries on the list */
+	struct list_head	spill;		/* what the full ring did not take */
 
 	pthread_mutex_t		mutex;
 	pthread_cond_t		cond;
@@ -412,22 +449,26 @@ static int sockopt_keepalive_cb(void *userdata, curl_socket_t fd,
 }
 #endif
 
-json_t *json_rpc_call(CURL *curl, const char *url,
-		      const char *userpass, const char *rpc_req,
-		      int *curl_err, int flags)
-{
-	json_t *val, *err_val, *res_val;
-	int rc;
-	long http_rc;
-	struct data_buffer all_data = {0};
+/* one JSON-RPC request over HTTP, from setup to the decoded answer */
+struct json_rpc_req {
+	CURL *curl;
+	int flags;
+	char *owned_req;
+	struct data_buffer all_data;
 	struct upload_buffer upload_data;
-	char *json_buf;
-	json_error_t err;
-	struct curl_slist *headers = NULL;
+	struct header_info hi;
+	struct curl_slist *headers;
 	char len_hdr[64];
-	char curl_err_str[CURL_ERROR_SIZE] = { 0 };
-	long timeout = (flags & JSON_RPC_LONGPOLL) ? opt_timeout : 30;
-	struct header_info hi = {0};
+	char curl_err_str[CURL_ERROR_SIZE];
+};
+
+static void json_rpc_setup(struct json_rpc_req *req, CURL *curl, const char *url,
+			   const char *userpass, const char *rpc_req, int flags,
+			   long timeout)
+{
+	memset(req, 0, sizeof(*req));
+	req->curl = curl;
+	req->flags = flags;
 
 	/* it is assumed that 'curl' is freshly [re]initialized at this pt */
 
@@ -442,19 +483,19 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
 	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, all_data_cb);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &all_data);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->all_data);
 	curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_data_cb);
-	curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &req->upload_data);
 #if LIBCURL_VERSION_NUM >= 0x071200
 	curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, &seek_data_cb);
-	curl_easy_setopt(curl, CURLOPT_SEEKDATA, &upload_data);
+	curl_easy_setopt(curl, CURLOPT_SEEKDATA, &req->upload_data);
 #endif
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->curl_err_str);
 	if (opt_redirect)
 		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
 	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hi);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &req->hi);
 	if (opt_proxy) {
 		curl_easy_setopt(curl, CURLOPT_PROXY, opt_proxy);
 		curl_easy_setopt(curl, CURLOPT_PROXYTYPE, opt_proxy_type);
@@ -472,56 +513,65 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	if (opt_protocol)
 		applog(LOG_DEBUG, "JSON protocol request:\n%s\n", rpc_req);
 
-	upload_data.buf = rpc_req;
-	upload_data.len = strlen(rpc_req);
-	upload_data.pos = 0;
-	sprintf(len_hdr, "Content-Length: %lu",
-		(unsigned long) upload_data.len);
+	req->upload_data.buf = rpc_req;
+	req->upload_data.len = strlen(rpc_req);
+	req->upload_data.pos = 0;
+	sprintf(req->len_hdr, "Content-Length: %lu",
+		(unsigned long) req->upload_data.len);
 
-	headers = curl_slist_append(headers, "Content-Type: application/json");
-	headers = curl_slist_append(headers, len_hdr);
-	headers = curl_slist_append(headers, "User-Agent: " USER_AGENT);
-	headers = curl_slist_append(headers, "X-Mining-Extensions: longpoll reject-reason");
+	req->headers = curl_slist_append(req->headers, "Content-Type: application/json");
+	req->headers = curl_slist_append(req->headers, req->len_hdr);
+	req->headers = curl_slist_append(req->headers, "User-Agent: " USER_AGENT);
+	req->headers = curl_slist_append(req->headers, "X-Mining-Extensions: longpoll reject-reason");
 	//headers = curl_slist_append(headers, "Accept:"); /* disable Accept hdr*/
 	//headers = curl_slist_append(headers, "Expect:"); /* disable Expect hdr*/
 
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+}
+
+static json_t *json_rpc_finish(struct json_rpc_req *req, int rc, int *curl_err)
+{
+	CURL *curl = req->curl;
+	int flags = req->flags;
+	json_t *val, *err_val, *res_val;
+	long http_rc;
+	char *json_buf;
+	json_error_t err;
 
-	rc = curl_easy_perform(curl);
 	if (curl_err != NULL)
 		*curl_err = rc;
 	if (rc) {
 		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
 		if (!((flags & JSON_RPC_LONGPOLL) && rc == CURLE_OPERATION_TIMEDOUT) &&
 		    !((flags & JSON_RPC_QUIET_404) && http_rc == 404))
-			applog(LOG_ERR, "HTTP request failed: %s", curl_err_str);
+			applog(LOG_ERR, "HTTP request failed: %s", req->curl_err_str);
 		if (curl_err && (flags & JSON_RPC_QUIET_404) && http_rc == 404)
 			*curl_err = CURLE_OK;
 		goto err_out;
 	}
 
 	/* If X-Stratum was found, activate Stratum */
-	if (want_stratum && hi.stratum_url &&
-	    !strncasecmp(hi.stratum_url, "stratum+tcp://", 14)) {
+	if (want_stratum && req->hi.stratum_url &&
+	    !strncasecmp(req->hi.stratum_url, "stratum+tcp://", 14)) {
 		have_stratum = true;
-		tq_push(thr_info[stratum_thr_id].q, hi.stratum_url);
-		hi.stratum_url = NULL;
+		tq_push(thr_info[stratum_thr_id].q, req->hi.stratum_url);
+		req->hi.stratum_url = NULL;
 	}
 
 	/* If X-Long-Polling was found, activate long polling */
-	if (!have_longpoll && want_longpoll && hi.lp_path && !have_gbt &&
+	if (!have_longpoll && want_longpoll && req->hi.lp_path && !have_gbt &&
 	    allow_getwork && !have_stratum) {
 		have_longpoll = true;
-		tq_push(thr_info[longpoll_thr_id].q, hi.lp_path);
-		hi.lp_path = NULL;
+		tq_push(thr_info[longpoll_thr_id].q, req->hi.lp_path);
+		req->hi.lp_path = NULL;
 	}
 
-	if (!all_data.buf) {
+	if (!req->all_data.buf) {
 		applog(LOG_ERR, "Empty data received in json_rpc_call.");
 		goto err_out;
 	}
 
-	json_buf = hack_json_numbers((char*) all_data.buf);
+	json_buf = hack_json_numbers((char*) req->all_data.buf);
 	errno = 0; /* needed for Jansson < 2.1 */
 	val = JSON_LOADS(json_buf, &err);
 	free(json_buf);
@@ -574,24 +624,70 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		goto err_out;
 	}
 
-	if (hi.reason)
-		json_object_set_new(val, "reject-reason", json_string(hi.reason));
+	if (req->hi.reason)
+		json_object_set_new(val, "reject-reason", json_string(req->hi.reason));
 
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
+	free(req->hi.lp_path);
+	free(req->hi.reason);
+	free(req->hi.stratum_url);
+	databuf_free(&req->all_data);
+	curl_slist_free_all(req->headers);
 	curl_easy_reset(curl);
 	return val;
 
 err_out:
-	free(hi.lp_path);
-	free(hi.reason);
-	free(hi.stratum_url);
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
+	free(req->hi.lp_path);
+	free(req->hi.reason);
+	free(req->hi.stratum_url);
+	databuf_free(&req->all_data);
+	curl_slist_free_all(req->headers);
 	curl_easy_reset(curl);
 	return NULL;
 }
 
+json_t *json_rpc_call(CURL *curl, const char *url,
+		      const char *userpass, const char *rpc_req,
+		      int *curl_err, int flags)
+{
+	struct json_rpc_req req;
+	long timeout = (flags & JSON_RPC_LONGPOLL) ? opt_timeout : 30;
+
+	json_rpc_setup(&req, curl, url, userpass, rpc_req, flags, timeout);
+	return json_rpc_finish(&req, curl_easy_perform(curl), curl_err);
+}
+
+/*
+ * The same call in two halves, for a caller that runs the transfer itself
+ * (on a curl multi handle): json_rpc_begin() sets the easy handle up, with
+ * a timeout of its own, and json_rpc_end() takes the transfer's result and
+ * returns the decoded answer like json_rpc_call() does.
+ */
+struct json_rpc_req *json_rpc_begin(CURL *curl, const char *url,
+		const char *userpass, const char *rpc_req, int flags, long timeout)
+{
+	struct json_rpc_req *req;
+	char *copy = strdup(rpc_req);
+
+	req = (struct json_rpc_req *) malloc(sizeof(*req));
+	if (!req || !copy) {
+		free(req);
+		free(copy);
+		return NULL;
+	}
+	json_rpc_setup(req, curl, url, userpass, copy, flags, timeout);
+	req->owned_req = copy;
+	return req;
+}
+
+json_t *json_rpc_end(struct json_rpc_req *req, int rc, int *curl_err)
+{
+	json_t *val = json_rpc_finish(req, rc, curl_err);
+
+	free(req->owned_req);
+	free(req);
+	return val;
+}
+
 /* used to load a remote config */
 json_t* json_load_url(char* cfg_url, json_error_t *err)
 {
@@ -2124,12 +2220,15 @@ out:
 struct thread_q *tq_new(void)
 {
 	struct thread_q *tq;
+	uint32_t i;
 
 	tq = (struct thread_q*) calloc(1, sizeof(*tq));
 	if (!tq)
 		return NULL;
 
-	INIT_LIST_HEAD(&tq->q);
+	for (i = 0; i < TQ_SIZE; i++)
+		tq->slot[i].seq = i;
+	INIT_LIST_HEAD(&tq->spill);
 	pthread_mutex_init(&tq->mutex, NULL);
 	pthread_cond_init(&tq->cond, NULL);
 
@@ -2143,7 +2242,7 @@ void tq_free(struct thread_q *tq)
 	if (!tq)
 		return;
 
-	list_for_each_entry_safe(ent, iter, &tq->q, q_node, struct tq_ent) {
+	list_for_each_entry_safe(ent, iter, &tq->spill, q_node, struct tq_ent) {
 		list_del(&ent->q_node);
 		free(ent);
 	}
@@ -2175,10 +2274,11 @@ void tq_thaw(struct thread_q *tq)
 	tq_freezethaw(tq, false);
 }
 
-bool tq_push(struct thread_q *tq, void *data)
+/* the ring is full, or was: onto the list behind what is already there */
+static bool tq_spill(struct thread_q *tq, void *data)
 {
 	struct tq_ent *ent;
-	bool rc = true;
+	bool first;
 
 	ent = (struct tq_ent*) calloc(1, sizeof(*ent));
 	if (!ent)
@@ -2188,49 +2288,104 @@ bool tq_push(struct thread_q *tq, void *data)
 	INIT_LIST_HEAD(&ent->q_node);
 
 	pthread_mutex_lock(&tq->mutex);
-
-	if (!tq->frozen) {
-		list_add_tail(&ent->q_node, &tq->q);
-	} else {
+	if (tq->frozen) {
+		pthread_mutex_unlock(&tq->mutex);
 		free(ent);
-		rc = false;
+		return false;
 	}
-
+	list_add_tail(&ent->q_node, &tq->spill);
+	first = !tq->spilled++;
 	pthread_cond_signal(&tq->cond);
 	pthread_mutex_unlock(&tq->mutex);
 
-	return rc;
+	if (first)
+		applog(LOG_WARNING, "Thread queue over %d entries, its consumer lags", TQ_SIZE);
+	return true;
 }
 
-void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
+/* the oldest entry of the list, mutex held */
+static bool tq_unspill(struct thread_q *tq, void **data)
 {
 	struct tq_ent *ent;
-	void *rval = NULL;
-	int rc;
 
-	pthread_mutex_lock(&tq->mutex);
+	if (list_empty(&tq->spill))
+		return false;
+	ent = list_entry(tq->spill.next, struct tq_ent, q_node);
+	*data = ent->data;
+	list_del(&ent->q_node);
+	free(ent);
+	tq->spilled--;
+	return true;
+}
 
-	if (!list_empty(&tq->q))
-		goto pop;
+bool tq_push(struct thread_q *tq, void *data)
+{
+	struct tq_slot *slot;
+	uint32_t pos;
+	int32_t dif;
 
-	if (abstime)
-		rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
-	else
-		rc = pthread_cond_wait(&tq->cond, &tq->mutex);
-	if (rc)
-		goto out;
-	if (list_empty(&tq->q))
-		goto out;
+	for (;;) {
+		if (tq->frozen)
+			return false;
+		/* behind the list while there is one */
+		if (tq->spilled)
+			return tq_spill(tq, data);
+		pos = tq->head;
+		slot = &tq->slot[pos % TQ_SIZE];
+		dif = (int32_t) (slot->seq - pos);
+		if (dif == 0) {
+			if (tq_cas(&tq->head, pos, pos + 1))
+				break;
+		} else if (dif < 0)
+			return tq_spill(tq, data);
+	}
 
-pop:
-	ent = list_entry(tq->q.next, struct tq_ent, q_node);
-	rval = ent->data;
+	slot->data = data;
+	tq_barrier();
+	slot->seq = pos + 1;
 
-	list_del(&ent->q_node);
-	free(ent);
+	tq_barrier();
+	if (tq->sleeping) {
+		pthread_mutex_lock(&tq->mutex);
+		pthread_cond_signal(&tq->cond);
+		pthread_mutex_unlock(&tq->mutex);
+	}
+	return true;
+}
 
-out:
-	pthread_mutex_unlock(&tq->mutex);
+/* the next entry into *data, if there is one */
+static bool tq_take(struct thread_q *tq, void **data)
+{
+	struct tq_slot *slot = &tq->slot[tq->tail % TQ_SIZE];
+
+	if (slot->seq != tq->tail + 1)
+		return false;
+	*data = slot->data;
+	tq_barrier();
+	slot->seq = tq->tail + TQ_SIZE;
+	tq->tail++;
+	return true;
+}
+
+void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
+{
+	void *rval = NULL;
+	int rc = 0;
+
+	/* the ring first, its entries are older than the list's */
+	if (!tq_take(tq, &rval)) {
+		pthread_mutex_lock(&tq->mutex);
+		tq->sleeping = 1;
+		tq_barrier();
+		while (!tq_take(tq, &rval) && !tq_unspill(tq, &rval) && !tq->frozen && !rc) {
+			if (abstime)
+				rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
+			else
+				rc = pthread_cond_wait(&tq->cond, &tq->mutex);
+		}
+		tq->sleeping = 0;
+		pthread_mutex_unlock(&tq->mutex);
+	}
 	return rval;
 }
 